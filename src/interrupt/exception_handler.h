@@ -1,4 +1,5 @@
 #include <interrupt/interrupt.h>
+#include <memory/vma.h>
 
 enum IRQ { DOUBLE_FAULT = 8, PAGE_FAULT = 14, TIMER = 32, KEYBOARD = 33 };
 
@@ -12,6 +13,11 @@ static inline uintptr_t read_cr2() {
 // can be non-fatal, e.g., for demand paging
 void page_fault_handler(interrupt_frame_t *frame) {
   uintptr_t fault_addr = read_cr2(); // Get faulting virtual address
+
+  // Demand paging: first touch of a lazily reserved page
+  if (vma_handle_fault(kernel_page_directory, fault_addr, frame->error_code))
+    return;
+
   printf("Page Fault! Fault address: %p, Error code: %d\n", fault_addr,
          frame->error_code);
   // Decode error code bits for more info
@@ -41,7 +47,8 @@ void default_handler(interrupt_frame_t *frame) {
 }
 
 void exception_handler(interrupt_frame_t *frame) {
-  if (frame->interrupt_num != TIMER && frame->interrupt_num != KEYBOARD) {
+  if (frame->interrupt_num != TIMER && frame->interrupt_num != KEYBOARD &&
+      frame->interrupt_num != PAGE_FAULT) {
     printf("Interrupt received! Vector: %d\n", frame->interrupt_num);
   }
 
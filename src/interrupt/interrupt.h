@@ -1,5 +1,6 @@
 #pragma once
 #include <interrupt/pic.h>
+#include <memory/pfa.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <terminal/keyboard.h>
@@ -122,6 +123,9 @@ void test_software_interrupt(void) {
 
 void test_hardware_interrupt(void) {
   while (1) {
-    __asm__ volatile("hlt"); // Low-power wait for interrupts
+    // Spend idle time pre-zeroing frames, sleep once there's nothing to do
+    if (!pfa_zero_pool_refill()) {
+      __asm__ volatile("hlt"); // Low-power wait for interrupts
+    }
   }
 }
@@ -1,9 +1,12 @@
 // main
 #include <interrupt/exception_handler.h>
 #include <interrupt/interrupt.h>
+#include <memory/arena.h>
 #include <memory/gdt.h>
+#include <memory/kalloc.h>
 #include <memory/memory.h>
 #include <memory/pfa.h>
+#include <memory/reclaim.h>
 #include <memory/vma.h>
 #include <module.h>
 #include <terminal/terminal.h>
@@ -19,12 +22,37 @@ void kernel_main(uint32_t magic, multiboot_info_t *boot_info) {
   init_idt();
   init_pfa(boot_info); // Call our initializer
   setup_recursive_pd();
+  setup_nx();
+  setup_pge();
+  setup_pat();
+  init_direct_map(vm_bitmap.max_phys_addr);
+  init_vma();
+  init_kalloc();
 
-  scan_pde_for_free(page_directory, true);
-  vma_alloc(page_directory, 2 * 1024 * 1024, NULL, 0);
-  scan_pde_for_free(page_directory, true);
+  scan_pde_for_free(kernel_page_directory, true);
+  vma_alloc(kernel_page_directory, 2 * 1024 * 1024, 0, 0);
+  scan_pde_for_free(kernel_page_directory, true);
 
   // test_software_interrupt();
   // start_module(boot_info);
+
+  // Boot is over: nothing reads the multiboot data or low identity addresses
+  // past this point
+  pfa_reclaim_boot_memory(boot_info, RECLAIM_ALL);
+
+  // Console writes are bursts (redraws, scrolling): remap the text buffer
+  // write-combining so they merge instead of going out one cell at a time.
+  // A frame must not have two memory types, so this waits for the identity
+  // map to be gone and drops the direct map alias as soon as the terminal
+  // has switched. For the few writes in between, the MTRRs keep the legacy
+  // VGA range uncached, so the alias never holds cache lines
+  uint32_t vga_bytes = VGA_WIDTH * VGA_HEIGHT * sizeof(uint16_t);
+  uintptr_t vga = vma_map_phys(kernel_page_directory, VGA_MEMORY_PHYS,
+                               vga_bytes, 0, VMA_WRITECOMBINE);
+  if (vga != 0) {
+    terminal_set_framebuffer((uint16_t *)vga);
+    vma_unmap_direct(VGA_MEMORY_PHYS, vga_bytes);
+  }
+
   test_hardware_interrupt();
 }
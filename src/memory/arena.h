@@ -0,0 +1,162 @@
+#pragma once
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <memory/vma.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <util/printf.h>
+#include <util/util.h>
+
+// Region (arena) allocator for data that dies together: setup tables built
+// once, scratch space for one operation. Allocation bumps a pointer through
+// the current chunk; there is no per-object free. Instead a mark taken with
+// arena_mark can be rolled back with arena_reset, and arena_destroy drops
+// everything at once.
+//
+//   arena_t scratch;
+//   arena_init(&scratch, "scratch", 0);
+//   arena_mark_t mark = arena_mark(&scratch);
+//   ... arena_alloc(&scratch, n) ...
+//   arena_reset(&scratch, mark); // Everything since the mark is gone
+//
+// Chunks are lazy vma_alloc regions. A page costs a frame once something is
+// written to it; the fault maps its untouched neighbours to the zero page. So
+// a chunk only costs frames up to the bump pointer and can be generous. A
+// request too big for a chunk gets one of its own.
+
+#define ARENA_CHUNK_DEFAULT (64 * 1024)
+#define ARENA_ALIGN 8 // Default alignment of arena_alloc
+
+typedef struct arena_chunk {
+  struct arena_chunk *prev; // Older chunk
+  uint32_t size;            // Bytes, header included
+} arena_chunk_t;
+
+typedef struct {
+  const char *name;
+  arena_chunk_t *current; // Newest chunk, NULL while empty
+  uint8_t *ptr;           // Next free byte in current
+  uint8_t *end;           // End of current
+  uint32_t chunk_size;
+
+  // Statistics
+  uint32_t chunks;
+  uint32_t bytes; // Handed out since the last reset or destroy
+} arena_t;
+
+// Position to roll back to
+typedef struct {
+  arena_chunk_t *chunk;
+  uint8_t *ptr;
+  uint32_t bytes;
+} arena_mark_t;
+
+// chunk_size 0 picks ARENA_CHUNK_DEFAULT. Nothing is allocated yet
+void arena_init(arena_t *arena, const char *name, uint32_t chunk_size) {
+  if (chunk_size == 0)
+    chunk_size = ARENA_CHUNK_DEFAULT;
+  arena->name = name;
+  arena->current = NULL;
+  arena->ptr = NULL;
+  arena->end = NULL;
+  arena->chunk_size = CEIL_DIV(chunk_size, PAGE_SIZE) * PAGE_SIZE;
+  arena->chunks = 0;
+  arena->bytes = 0;
+}
+
+static void arena_free_chunk(arena_t *arena, arena_chunk_t *chunk) {
+  vma_free(kernel_page_directory, (uintptr_t)chunk, chunk->size);
+  arena->chunks--;
+}
+
+// Start a new chunk with room for at least size bytes at the given alignment
+static bool arena_grow(arena_t *arena, uint32_t size, uint32_t align) {
+  uint32_t need = sizeof(arena_chunk_t) + align - 1 + size;
+  uint32_t bytes = arena->chunk_size;
+  if (need < size)
+    return false; // Wrapped around
+  if (need > bytes)
+    bytes = CEIL_DIV(need, PAGE_SIZE) * PAGE_SIZE;
+
+  arena_chunk_t *chunk =
+      (arena_chunk_t *)vma_alloc(kernel_page_directory, bytes, 0, VMA_LAZY);
+  if (chunk == NULL) {
+    printf("ARENA: %s out of memory for %u bytes\n", arena->name, size);
+    return false;
+  }
+
+  chunk->prev = arena->current;
+  chunk->size = bytes;
+  arena->current = chunk;
+  arena->ptr = (uint8_t *)(chunk + 1);
+  arena->end = (uint8_t *)chunk + bytes;
+  arena->chunks++;
+  return true;
+}
+
+// size bytes aligned to align (a power of two), or NULL when out of memory
+void *arena_alloc_aligned(arena_t *arena, uint32_t size, uint32_t align) {
+  if (size == 0 || (align & (align - 1)))
+    return NULL;
+
+  uintptr_t p = ((uintptr_t)arena->ptr + align - 1) & ~(uintptr_t)(align - 1);
+  if (arena->current == NULL || p < (uintptr_t)arena->ptr ||
+      p > (uintptr_t)arena->end || size > (uintptr_t)arena->end - p) {
+    // The rest of the current chunk is left behind
+    if (!arena_grow(arena, size, align))
+      return NULL;
+    p = ((uintptr_t)arena->ptr + align - 1) & ~(uintptr_t)(align - 1);
+  }
+
+  arena->ptr = (uint8_t *)(p + size);
+  arena->bytes += size;
+  return (void *)p;
+}
+
+void *arena_alloc(arena_t *arena, uint32_t size) {
+  return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+// Zero-filled, for tables that expect it
+void *arena_zalloc(arena_t *arena, uint32_t size) {
+  void *p = arena_alloc(arena, size);
+  if (p != NULL)
+    memset(p, 0, size);
+  return p;
+}
+
+arena_mark_t arena_mark(const arena_t *arena) {
+  arena_mark_t mark = {arena->current, arena->ptr, arena->bytes};
+  return mark;
+}
+
+// Roll back to mark: every allocation made since is gone, and so are the
+// chunks started since
+void arena_reset(arena_t *arena, arena_mark_t mark) {
+  while (arena->current != mark.chunk) {
+    if (arena->current == NULL) {
+      printf("ARENA: %s reset to a mark that isn't in it\n", arena->name);
+      return;
+    }
+    arena_chunk_t *prev = arena->current->prev;
+    arena_free_chunk(arena, arena->current);
+    arena->current = prev;
+  }
+
+  arena->ptr = mark.ptr;
+  arena->end = mark.chunk != NULL ? (uint8_t *)mark.chunk + mark.chunk->size
+                                  : NULL;
+  arena->bytes = mark.bytes;
+}
+
+// Free everything, the arena can be reused afterwards
+void arena_destroy(arena_t *arena) {
+  arena_mark_t empty = {NULL, NULL, 0};
+  arena_reset(arena, empty);
+}
+
+void arena_print_stats(const arena_t *arena) {
+  printf("ARENA: %s: %u bytes in %u chunks of %u KB\n", arena->name,
+         arena->bytes, arena->chunks, arena->chunk_size / 1024);
+}
@@ -0,0 +1,235 @@
+#pragma once
+#include <memory/paging.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <util/bitmap.h>
+#include <util/printf.h>
+#include <util/util.h>
+
+// Binary buddy allocator over physical frames. A block of order k is 2^k
+// contiguous frames, aligned to its own size. Orders 0-10 cover 4 KB to 4 MB.
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_NUM_ORDERS (BUDDY_MAX_ORDER + 1)
+#define BUDDY_BLOCK_FRAMES(order) (1u << (order))
+
+extern vm_bitmap_t vm_bitmap;
+
+// Free blocks of one order. Instead of linked lists (free frames aren't mapped,
+// so we can't store list nodes in them) every order has its own free bitmap
+// with a summary level on top, one summary bit per bitmap word that still has
+// a free block. The cursor marks the first summary word that may be non-zero.
+typedef struct {
+  uint32_t *free;       // Bit set = block is free at this order
+  uint32_t *summary;    // Bit set = free[] word has at least one free block
+  uint32_t num_words;   // Words in free[]
+  uint32_t cursor;      // Every summary word below this one is zero
+  uint32_t free_blocks; // Number of bits set in free[]
+} buddy_order_t;
+
+// One independent buddy allocator over a frame range. The range starts on a
+// max-order boundary so relative and absolute block alignment agree, and no
+// block (or buddy) ever crosses into a neighbouring area.
+typedef struct {
+  uint32_t start_frame;
+  uint32_t num_frames;
+  buddy_order_t orders[BUDDY_NUM_ORDERS];
+} buddy_area_t;
+
+// Backing storage shared by all areas, placed by the PFA at boot (see
+// buddy_set_storage). Order k needs num_frames >> k bits, so the sum over all
+// orders stays below 2 * num_frames bits (32 KB for 512 MB of RAM, 256 KB for
+// 4 GB). Every area may round each order up by one word.
+#define BUDDY_MAX_AREAS NUM_ZONES // One area per zone, see zone.h
+#define BUDDY_FREE_WORDS(frames)                                               \
+  (2 * (frames) / 32 + BUDDY_MAX_AREAS * BUDDY_NUM_ORDERS)
+#define BUDDY_SUMMARY_WORDS(frames)                                            \
+  (BUDDY_FREE_WORDS(frames) / 32 + BUDDY_MAX_AREAS * BUDDY_NUM_ORDERS)
+
+static uint32_t *buddy_free_storage = NULL;
+static uint32_t *buddy_summary_storage = NULL;
+static uint32_t buddy_free_words = 0; // Capacity of the storage
+static uint32_t buddy_summary_words = 0;
+static uint32_t buddy_free_used = 0;    // Words handed out so far
+static uint32_t buddy_summary_used = 0;
+
+// Hand the allocator its bitmap storage, sized with BUDDY_FREE_WORDS and
+// BUDDY_SUMMARY_WORDS for the frames it will manage. Call before buddy_init
+static void buddy_set_storage(uint32_t *free_storage, uint32_t free_words,
+                              uint32_t *summary_storage,
+                              uint32_t summary_words) {
+  buddy_free_storage = free_storage;
+  buddy_free_words = free_words;
+  buddy_summary_storage = summary_storage;
+  buddy_summary_words = summary_words;
+  buddy_free_used = 0;
+  buddy_summary_used = 0;
+}
+
+// ============= Per-Order Bitmap Helpers =============
+
+static bool buddy_test(buddy_order_t *order, uint32_t block) {
+  uint32_t word = block / 32;
+  if (word >= order->num_words)
+    return false;
+  return (order->free[word] & (1u << (block % 32))) != 0;
+}
+
+static void buddy_set(buddy_order_t *order, uint32_t block) {
+  uint32_t word = block / 32;
+  order->free[word] |= 1u << (block % 32);
+  order->summary[word / 32] |= 1u << (word % 32);
+  if (word / 32 < order->cursor) {
+    order->cursor = word / 32;
+  }
+  order->free_blocks++;
+}
+
+static void buddy_clear(buddy_order_t *order, uint32_t block) {
+  uint32_t word = block / 32;
+  order->free[word] &= ~(1u << (block % 32));
+  if (order->free[word] == 0) {
+    order->summary[word / 32] &= ~(1u << (word % 32));
+  }
+  order->free_blocks--;
+}
+
+// Lowest free block of this order, or -1
+static int32_t buddy_find(buddy_order_t *order) {
+  uint32_t num_summary = CEIL_DIV(order->num_words, 32);
+
+  for (uint32_t s = order->cursor; s < num_summary; s++) {
+    if (order->summary[s] == 0)
+      continue;
+
+    order->cursor = s;
+    uint32_t word = s * 32 + __builtin_ctz(order->summary[s]);
+    return word * 32 + __builtin_ctz(order->free[word]);
+  }
+
+  order->cursor = num_summary;
+  return -1;
+}
+
+// ============= Initialization =============
+
+// Carve the bitmaps for each order of an area out of the shared storage,
+// sized for the frames the area actually covers
+static void buddy_init(buddy_area_t *area, uint32_t start_frame,
+                       uint32_t num_frames) {
+  area->start_frame = start_frame;
+  area->num_frames = num_frames;
+
+  for (uint32_t k = 0; k < BUDDY_NUM_ORDERS; k++) {
+    uint32_t num_blocks = CEIL_DIV(num_frames, BUDDY_BLOCK_FRAMES(k));
+    buddy_order_t *order = &area->orders[k];
+
+    order->num_words = CEIL_DIV(num_blocks, 32);
+    uint32_t num_summary = CEIL_DIV(order->num_words, 32);
+    if (buddy_free_used + order->num_words > buddy_free_words ||
+        buddy_summary_used + num_summary > buddy_summary_words) {
+      printf("BUDDY: Out of bitmap storage, area at frame %u disabled\n",
+             start_frame);
+      area->num_frames = 0;
+      return;
+    }
+
+    order->free = &buddy_free_storage[buddy_free_used];
+    order->summary = &buddy_summary_storage[buddy_summary_used];
+    order->cursor = 0;
+    order->free_blocks = 0;
+
+    memset32(order->free, 0, order->num_words);
+    memset32(order->summary, 0, num_summary);
+    buddy_free_used += order->num_words;
+    buddy_summary_used += num_summary;
+  }
+}
+
+// Hand the free run [start, end) (absolute frames inside the area) to the
+// allocator as the largest naturally aligned blocks that fit
+static void buddy_seed_range(buddy_area_t *area, uint32_t start,
+                             uint32_t end) {
+  start -= area->start_frame;
+  end -= area->start_frame;
+
+  while (start < end) {
+    uint32_t k = BUDDY_MAX_ORDER;
+    while (k > 0 && ((start & (BUDDY_BLOCK_FRAMES(k) - 1)) != 0 ||
+                     start + BUDDY_BLOCK_FRAMES(k) > end)) {
+      k--;
+    }
+
+    buddy_set(&area->orders[k], start >> k);
+    start += BUDDY_BLOCK_FRAMES(k);
+  }
+}
+
+// Seed the free lists from the frame bitmap: every run of free frames inside
+// the area left after the memory map was applied and the reservations made.
+// Returns the number of frames handed over.
+static uint32_t buddy_seed_from_bitmap(buddy_area_t *area) {
+  uint32_t start = area->start_frame;
+  uint32_t end = area->start_frame + area->num_frames;
+  uint32_t seeded = 0;
+  uint32_t run_start = bitmap_find_next_clear(vm_bitmap.bitmap, start, end);
+
+  while (run_start < end) {
+    uint32_t run_end = bitmap_find_next_set(vm_bitmap.bitmap, run_start, end);
+    buddy_seed_range(area, run_start, run_end);
+    seeded += run_end - run_start;
+    run_start = bitmap_find_next_clear(vm_bitmap.bitmap, run_end, end);
+  }
+
+  return seeded;
+}
+
+// ============= Allocation =============
+
+// Take a block of the requested order, splitting a larger one if needed.
+// Returns the first (absolute) frame number, or -1 when nothing large enough
+// is free in this area.
+static int32_t buddy_alloc(buddy_area_t *area, uint32_t order) {
+  if (area->num_frames == 0)
+    return -1;
+
+  for (uint32_t k = order; k < BUDDY_NUM_ORDERS; k++) {
+    int32_t block = buddy_find(&area->orders[k]);
+    if (block < 0)
+      continue;
+
+    buddy_clear(&area->orders[k], block);
+
+    // Split down, returning the upper half at every level
+    while (k > order) {
+      k--;
+      block <<= 1;
+      buddy_set(&area->orders[k], block + 1);
+    }
+
+    return area->start_frame + (block << order);
+  }
+
+  return -1;
+}
+
+// Return a block and merge it with its buddy for as long as the buddy is free
+static void buddy_free(buddy_area_t *area, uint32_t frame, uint32_t order) {
+  uint32_t block = (frame - area->start_frame) >> order;
+
+  while (order < BUDDY_MAX_ORDER &&
+         buddy_test(&area->orders[order], block ^ 1)) {
+    buddy_clear(&area->orders[order], block ^ 1);
+    block >>= 1;
+    order++;
+  }
+
+  buddy_set(&area->orders[order], block);
+}
+
+void buddy_print_stats(buddy_area_t *area) {
+  printf("BUDDY: Free blocks per order:\n");
+  for (uint32_t k = 0; k < BUDDY_NUM_ORDERS; k++) {
+    printf("  - Order %u (%u KB): %u\n", k, BUDDY_BLOCK_FRAMES(k) * 4,
+           area->orders[k].free_blocks);
+  }
+}
@@ -0,0 +1,855 @@
+#pragma once
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <memory/pfa.h>
+#include <memory/vma.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <util/percpu.h>
+#include <util/printf.h>
+#include <util/util.h>
+
+// ============= Slab Allocator =============
+// Fixed-size kernel objects come from named caches, one per object type. A
+// cache carves buddy blocks of directly mapped frames (slabs) into equal
+// objects, so allocating and freeing is a free list pop/push, and objects of
+// different types never fragment each other's pages.
+//
+// Each slab starts with its header, followed by a bufctl array of 16-bit
+// "next free" indices, one per object, then the objects. Free objects are
+// chained through bufctl rather than through their own memory, so whatever a
+// constructor set up survives until the object is handed out again. Slabs
+// are aligned to their size, which makes the slab of an object a mask away.
+//
+// The space a slab can't fill with objects is used for colouring: successive
+// slabs shift their first object by one more cache line, so objects at the
+// same index in different slabs don't all compete for the same cache sets.
+//
+// In front of the slabs sits a per-CPU magazine layer (Bonwick-style, like
+// the PFA's frame magazines): each CPU holds a loaded and a previous magazine
+// of free objects per cache, and a per-cache depot keeps spare full and empty
+// magazines. Alloc and free only touch the CPU's own magazines with
+// interrupts off, no atomics, and take the depot's spinlock once per magazine.
+// That lock also covers the few other fields CPUs share: slab colouring and
+// the slab counters.
+//
+// Slabs belong to the CPU that grew them and only that CPU touches their
+// lists. An object that ends up freed to the slab layer of another CPU is
+// pushed onto that CPU's remote free list, a lock-free MPSC stack, which the
+// owner drains the next time it needs its slabs.
+
+#define KMEM_MAX_ORDER 4        // Largest slab, 16 pages
+#define KMEM_MIN_ALIGN 8
+#define KMEM_NAME_LEN 16
+#define KMEM_FREE_END 0xFFFF    // bufctl terminator
+#define KMEM_MAX_OBJS 0xFFFE
+#define KMEM_KEEP_EMPTY 1       // Empty slabs kept per CPU before freeing
+#define KMEM_MAG_SIZE 14        // Objects per magazine, one cache line
+#define KMEM_DEPOT_MAX 8        // Full magazines the depot holds per cache
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+struct kmem_cache;
+
+typedef struct kmem_slab {
+  struct kmem_slab *next;
+  struct kmem_slab *prev;
+  struct kmem_cache *cache;
+  uint8_t *objs;    // First object, after the colour offset
+  uint16_t in_use;
+  uint16_t free;    // First free object, KMEM_FREE_END when full
+  uint16_t cpu;     // Owner, the CPU that grew it
+  uint16_t bufctl[]; // Next free object after each free one
+} kmem_slab_t;
+
+typedef struct {
+  kmem_slab_t *head;
+  uint32_t count;
+} kmem_slab_list_t;
+
+typedef struct kmem_magazine {
+  struct kmem_magazine *next; // Depot list
+  uint32_t count;
+  void *rounds[KMEM_MAG_SIZE];
+} kmem_magazine_t;
+
+typedef struct {
+  // Magazine layer, either may be NULL until first needed
+  kmem_magazine_t *loaded;
+  kmem_magazine_t *previous;
+
+  // Slab layer: the slabs this CPU grew
+  kmem_slab_list_t full;
+  kmem_slab_list_t partial;
+  kmem_slab_list_t empty;
+
+  // Objects of this CPU's slabs freed by other CPUs, chained through their
+  // link word. Any CPU pushes, only the owner takes the whole list
+  void *remote_free;
+
+  // Statistics
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t mag_hits; // Allocs and frees served by the magazines
+  uint32_t remote_frees;
+} __cacheline_aligned kmem_cpu_cache_t;
+
+typedef struct kmem_cache {
+  char name[KMEM_NAME_LEN];
+  uint32_t obj_size; // Rounded up to the alignment
+  uint32_t align;
+  kmem_ctor_t ctor;
+  uint32_t link_offset; // Word in a free object used by the remote list
+  bool magazines;       // Off for the caches the magazine layer relies on
+
+  uint32_t order; // Slab size is PAGE_SIZE << order
+  uint32_t objs_per_slab;
+  uint32_t objs_offset; // Header and bufctl, before any colouring
+  uint32_t colour_max;  // Number of distinct colour offsets
+  uint32_t colour_next; // Under depot_lock
+  uint32_t colour_align;
+
+  kmem_cpu_cache_t cpu[MAX_CPUS];
+
+  // Depot. Taken once per magazine of work, so its lock stays cold. The lock
+  // also guards colour_next and the statistics below
+  spinlock_t depot_lock;
+  kmem_magazine_t *depot_full;
+  kmem_magazine_t *depot_empty;
+  uint32_t depot_full_count;
+
+  // Statistics
+  uint32_t slab_allocs;
+  uint32_t slab_frees;
+  uint32_t depot_exchanges;
+
+  struct kmem_cache *next_cache; // Every cache, for the stats
+} kmem_cache_t;
+
+// Cache descriptors come from a cache of their own, which has to be set up
+// by hand since there's nothing to allocate it from yet. Magazines come from
+// another one, which doesn't use magazines itself
+static kmem_cache_t kmem_cache_cache;
+static kmem_cache_t *kmem_magazine_cache = NULL;
+static kmem_cache_t *kmem_caches = NULL;
+static spinlock_t kmem_caches_lock = SPINLOCK_INIT;
+
+static inline uint32_t kmem_slab_bytes(const kmem_cache_t *cache) {
+  return PAGE_SIZE << cache->order;
+}
+
+static void kmem_list_add(kmem_slab_list_t *list, kmem_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = list->head;
+  if (list->head != NULL)
+    list->head->prev = slab;
+  list->head = slab;
+  list->count++;
+}
+
+static void kmem_list_remove(kmem_slab_list_t *list, kmem_slab_t *slab) {
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    list->head = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+  list->count--;
+}
+
+// Objects fitting into a slab of the given order, after header, bufctl and
+// alignment. *waste gets the bytes left over
+static uint32_t kmem_fit(uint32_t order, uint32_t size, uint32_t align,
+                         uint32_t *waste) {
+  uint32_t slab_bytes = PAGE_SIZE << order;
+  uint32_t n = (slab_bytes - sizeof(kmem_slab_t)) / (size + sizeof(uint16_t));
+  if (n > KMEM_MAX_OBJS)
+    n = KMEM_MAX_OBJS;
+
+  while (n > 0) {
+    uint32_t offset = sizeof(kmem_slab_t) + n * sizeof(uint16_t);
+    offset = (offset + align - 1) & ~(align - 1);
+    if (offset + n * size <= slab_bytes) {
+      *waste = slab_bytes - offset - n * size;
+      return n;
+    }
+    n--;
+  }
+  *waste = slab_bytes;
+  return 0;
+}
+
+// Lay the cache's slabs out for the given order. Only before the first slab
+static void kmem_cache_set_order(kmem_cache_t *cache, uint32_t order) {
+  uint32_t waste;
+  uint32_t n = kmem_fit(order, cache->obj_size, cache->align, &waste);
+
+  cache->order = order;
+  cache->objs_per_slab = n;
+  uint32_t offset = sizeof(kmem_slab_t) + n * sizeof(uint16_t);
+  cache->objs_offset = (offset + cache->align - 1) & ~(cache->align - 1);
+  cache->colour_align =
+      cache->align > CACHE_LINE_SIZE ? cache->align : CACHE_LINE_SIZE;
+  cache->colour_max = waste / cache->colour_align + 1;
+  cache->colour_next = 0;
+}
+
+// Smallest slab that wastes at most an eighth of itself, or the least
+// wasteful one if none does
+static void kmem_cache_size(kmem_cache_t *cache) {
+  uint32_t best_order = 0, best_waste = 0, best_n = 0;
+  for (uint32_t order = 0; order <= KMEM_MAX_ORDER; order++) {
+    uint32_t slab_bytes = PAGE_SIZE << order;
+    uint32_t waste;
+    uint32_t n = kmem_fit(order, cache->obj_size, cache->align, &waste);
+    if (n == 0)
+      continue;
+
+    // Compare waste fractions without dividing
+    if (best_n == 0 || (uint64_t)waste * (PAGE_SIZE << best_order) <
+                           (uint64_t)best_waste * slab_bytes) {
+      best_order = order;
+      best_waste = waste;
+      best_n = n;
+    }
+    if (waste <= slab_bytes / 8)
+      break;
+  }
+
+  kmem_cache_set_order(cache, best_order);
+}
+
+static void kmem_cache_setup(kmem_cache_t *cache, const char *name,
+                             uint32_t size, uint32_t align, kmem_ctor_t ctor) {
+  memset(cache, 0, sizeof(kmem_cache_t));
+  uint32_t i = 0;
+  for (; name[i] != '\0' && i < KMEM_NAME_LEN - 1; i++) {
+    cache->name[i] = name[i];
+  }
+  cache->name[i] = '\0';
+
+  if (align < KMEM_MIN_ALIGN)
+    align = KMEM_MIN_ALIGN;
+  cache->align = align;
+  cache->obj_size = (size + align - 1) & ~(align - 1);
+  cache->ctor = ctor;
+  cache->magazines = true;
+
+  // A free object's first word is fair game for the remote free list, unless
+  // it has to stay constructed: then it gets a hidden word of its own
+  if (ctor != NULL) {
+    cache->link_offset = cache->obj_size;
+    cache->obj_size =
+        (cache->obj_size + sizeof(void *) + align - 1) & ~(align - 1);
+  }
+  kmem_cache_size(cache);
+
+  spin_lock(&kmem_caches_lock);
+  cache->next_cache = kmem_caches;
+  kmem_caches = cache;
+  spin_unlock(&kmem_caches_lock);
+}
+
+static inline kmem_slab_t *kmem_obj_slab(const kmem_cache_t *cache,
+                                         const void *obj) {
+  return (kmem_slab_t *)((uintptr_t)obj &
+                         ~(uintptr_t)(kmem_slab_bytes(cache) - 1));
+}
+
+static inline void **kmem_obj_link(const kmem_cache_t *cache, void *obj) {
+  return (void **)((uint8_t *)obj + cache->link_offset);
+}
+
+// ---- Slab layer. Callers have interrupts disabled and pass their own CPU
+
+// Get a new slab from the PFA and chain all its objects into the free list
+static kmem_slab_t *kmem_slab_grow(kmem_cache_t *cache, uint32_t cpu) {
+  phys_addr_t phys = pfa_alloc_order(cache->order);
+  if (phys == 0)
+    return NULL;
+
+  spin_lock(&cache->depot_lock);
+  uint32_t colour = cache->colour_next;
+  cache->colour_next = (colour + 1) % cache->colour_max;
+  cache->slab_allocs++;
+  spin_unlock(&cache->depot_lock);
+
+  kmem_slab_t *slab = (kmem_slab_t *)phys_to_virt(phys);
+  slab->cache = cache;
+  slab->objs =
+      (uint8_t *)slab + cache->objs_offset + colour * cache->colour_align;
+  slab->in_use = 0;
+  slab->free = 0;
+  slab->cpu = cpu;
+  for (uint32_t i = 0; i < cache->objs_per_slab; i++) {
+    slab->bufctl[i] = (i + 1 < cache->objs_per_slab) ? i + 1 : KMEM_FREE_END;
+    if (cache->ctor != NULL)
+      cache->ctor(slab->objs + i * cache->obj_size);
+  }
+  return slab;
+}
+
+static void kmem_slab_release(kmem_cache_t *cache, kmem_slab_t *slab) {
+  pfa_free_order(virt_to_phys(slab), cache->order);
+  spin_lock(&cache->depot_lock);
+  cache->slab_frees++;
+  spin_unlock(&cache->depot_lock);
+}
+
+// Put an object back into one of this CPU's slabs
+static void kmem_slab_put(kmem_cache_t *cache, kmem_cpu_cache_t *pc,
+                          kmem_slab_t *slab, void *obj) {
+  uint16_t index = ((uint8_t *)obj - slab->objs) / cache->obj_size;
+  bool was_full = slab->free == KMEM_FREE_END;
+  slab->bufctl[index] = slab->free;
+  slab->free = index;
+  slab->in_use--;
+
+  if (slab->in_use == 0) {
+    kmem_list_remove(was_full ? &pc->full : &pc->partial, slab);
+    if (pc->empty.count < KMEM_KEEP_EMPTY) {
+      kmem_list_add(&pc->empty, slab);
+    } else {
+      kmem_slab_release(cache, slab);
+    }
+  } else if (was_full) {
+    kmem_list_remove(&pc->full, slab);
+    kmem_list_add(&pc->partial, slab);
+  }
+}
+
+// Take back everything other CPUs freed into this CPU's slabs. The exchange
+// grabs the whole stack at once, so there's no ABA to worry about
+static void kmem_remote_drain(kmem_cache_t *cache, kmem_cpu_cache_t *pc) {
+  if (__atomic_load_n(&pc->remote_free, __ATOMIC_RELAXED) == NULL)
+    return;
+
+  void *obj = __atomic_exchange_n(&pc->remote_free, NULL, __ATOMIC_ACQUIRE);
+  while (obj != NULL) {
+    void *next = *kmem_obj_link(cache, obj);
+    kmem_slab_put(cache, pc, kmem_obj_slab(cache, obj), obj);
+    obj = next;
+  }
+}
+
+static void *kmem_slab_alloc(kmem_cache_t *cache, uint32_t cpu) {
+  kmem_cpu_cache_t *pc = &cache->cpu[cpu];
+  kmem_remote_drain(cache, pc);
+
+  kmem_slab_t *slab = pc->partial.head;
+  if (slab == NULL) {
+    slab = pc->empty.head;
+    if (slab != NULL) {
+      kmem_list_remove(&pc->empty, slab);
+    } else {
+      slab = kmem_slab_grow(cache, cpu);
+      if (slab == NULL)
+        return NULL;
+    }
+    kmem_list_add(&pc->partial, slab);
+  }
+
+  uint16_t index = slab->free;
+  slab->free = slab->bufctl[index];
+  slab->in_use++;
+  if (slab->free == KMEM_FREE_END) {
+    kmem_list_remove(&pc->partial, slab);
+    kmem_list_add(&pc->full, slab);
+  }
+  return slab->objs + index * cache->obj_size;
+}
+
+static void kmem_slab_free(kmem_cache_t *cache, uint32_t cpu, void *obj) {
+  kmem_slab_t *slab = kmem_obj_slab(cache, obj);
+  if (slab->cpu == cpu) {
+    kmem_slab_put(cache, &cache->cpu[cpu], slab, obj);
+    return;
+  }
+
+  // Someone else's slab: hand it over without touching their lists
+  kmem_cpu_cache_t *owner = &cache->cpu[slab->cpu];
+  void **link = kmem_obj_link(cache, obj);
+  void *head = __atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+  do {
+    *link = head;
+  } while (!__atomic_compare_exchange_n(&owner->remote_free, &head, obj, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  cache->cpu[cpu].remote_frees++;
+}
+
+// Return a magazine's objects to the slab layer, the magazine stays
+static void kmem_mag_empty(kmem_cache_t *cache, uint32_t cpu,
+                           kmem_magazine_t *mag) {
+  while (mag->count > 0) {
+    kmem_slab_free(cache, cpu, mag->rounds[--mag->count]);
+  }
+}
+
+// ---- Magazine layer
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+  uint32_t flags = irq_save();
+  uint32_t cpu = cpu_id();
+  kmem_cpu_cache_t *pc = &cache->cpu[cpu];
+  void *obj = NULL;
+
+  if (cache->magazines) {
+    if (pc->loaded == NULL || pc->loaded->count == 0) {
+      if (pc->previous != NULL && pc->previous->count > 0) {
+        kmem_magazine_t *tmp = pc->loaded;
+        pc->loaded = pc->previous;
+        pc->previous = tmp;
+      } else if (cache->depot_full != NULL) {
+        // Trade the empty loaded magazine for a full one. The unlocked peek
+        // only saves taking the lock when the depot looks empty
+        spin_lock(&cache->depot_lock);
+        kmem_magazine_t *full = cache->depot_full;
+        if (full != NULL) {
+          cache->depot_full = full->next;
+          cache->depot_full_count--;
+          if (pc->loaded != NULL) {
+            pc->loaded->next = cache->depot_empty;
+            cache->depot_empty = pc->loaded;
+          }
+          pc->loaded = full;
+          cache->depot_exchanges++;
+        }
+        spin_unlock(&cache->depot_lock);
+      }
+    }
+    if (pc->loaded != NULL && pc->loaded->count > 0) {
+      obj = pc->loaded->rounds[--pc->loaded->count];
+      pc->mag_hits++;
+    }
+  }
+
+  if (obj == NULL)
+    obj = kmem_slab_alloc(cache, cpu);
+  if (obj != NULL)
+    pc->allocs++;
+
+  irq_restore(flags);
+  if (obj == NULL)
+    printf("SLAB: Out of memory growing %s\n", cache->name);
+  return obj;
+}
+
+// An empty magazine for the free path: a spare from the depot, or a new one
+static kmem_magazine_t *kmem_mag_get_empty(kmem_cache_t *cache) {
+  spin_lock(&cache->depot_lock);
+  kmem_magazine_t *mag = cache->depot_empty;
+  if (mag != NULL)
+    cache->depot_empty = mag->next;
+  spin_unlock(&cache->depot_lock);
+  if (mag != NULL)
+    return mag;
+
+  mag = kmem_cache_alloc(kmem_magazine_cache);
+  if (mag != NULL)
+    mag->count = 0;
+  return mag;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+  if (obj == NULL)
+    return;
+
+  if (kmem_obj_slab(cache, obj)->cache != cache) {
+    printf("SLAB: Free of %p into the wrong cache (%s)\n", obj, cache->name);
+    return;
+  }
+
+  uint32_t flags = irq_save();
+  uint32_t cpu = cpu_id();
+  kmem_cpu_cache_t *pc = &cache->cpu[cpu];
+  pc->frees++;
+
+  if (cache->magazines) {
+    if (pc->loaded == NULL || pc->loaded->count == KMEM_MAG_SIZE) {
+      if (pc->previous != NULL && pc->previous->count < KMEM_MAG_SIZE) {
+        kmem_magazine_t *tmp = pc->loaded;
+        pc->loaded = pc->previous;
+        pc->previous = tmp;
+      } else {
+        kmem_magazine_t *empty = kmem_mag_get_empty(cache);
+        if (empty != NULL) {
+          // Retire the full previous magazine to the depot, or straight to
+          // the slabs if the depot already holds enough
+          kmem_magazine_t *full = pc->previous;
+          spin_lock(&cache->depot_lock);
+          if (full != NULL && cache->depot_full_count < KMEM_DEPOT_MAX) {
+            full->next = cache->depot_full;
+            cache->depot_full = full;
+            cache->depot_full_count++;
+            full = NULL;
+          }
+          cache->depot_exchanges++;
+          spin_unlock(&cache->depot_lock);
+
+          // Emptying it reaches the slab layer, which may take the lock
+          if (full != NULL) {
+            kmem_mag_empty(cache, cpu, full);
+            spin_lock(&cache->depot_lock);
+            full->next = cache->depot_empty;
+            cache->depot_empty = full;
+            spin_unlock(&cache->depot_lock);
+          }
+          pc->previous = pc->loaded;
+          pc->loaded = empty;
+        }
+      }
+    }
+    if (pc->loaded != NULL && pc->loaded->count < KMEM_MAG_SIZE) {
+      pc->loaded->rounds[pc->loaded->count++] = obj;
+      pc->mag_hits++;
+      irq_restore(flags);
+      return;
+    }
+  }
+
+  kmem_slab_free(cache, cpu, obj);
+  irq_restore(flags);
+}
+
+// Objects handed out and not yet freed, across all CPUs
+uint32_t kmem_cache_active(const kmem_cache_t *cache) {
+  uint32_t active = 0;
+  for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    active += cache->cpu[cpu].allocs - cache->cpu[cpu].frees;
+  }
+  return active;
+}
+
+// Flush the depot and this CPU's magazines into the slabs and give every
+// empty slab back to the PFA. Other CPUs' magazines are theirs to flush
+void kmem_cache_shrink(kmem_cache_t *cache) {
+  uint32_t flags = irq_save();
+  uint32_t cpu = cpu_id();
+  kmem_cpu_cache_t *pc = &cache->cpu[cpu];
+
+  spin_lock(&cache->depot_lock);
+  kmem_magazine_t *mags = cache->depot_full;
+  cache->depot_full = NULL;
+  cache->depot_full_count = 0;
+  kmem_magazine_t *spare = cache->depot_empty;
+  cache->depot_empty = NULL;
+  spin_unlock(&cache->depot_lock);
+  if (pc->loaded != NULL) {
+    pc->loaded->next = mags;
+    mags = pc->loaded;
+    pc->loaded = NULL;
+  }
+  if (pc->previous != NULL) {
+    pc->previous->next = mags;
+    mags = pc->previous;
+    pc->previous = NULL;
+  }
+
+  while (mags != NULL) {
+    kmem_magazine_t *next = mags->next;
+    kmem_mag_empty(cache, cpu, mags);
+    kmem_cache_free(kmem_magazine_cache, mags);
+    mags = next;
+  }
+  while (spare != NULL) {
+    kmem_magazine_t *next = spare->next;
+    kmem_cache_free(kmem_magazine_cache, spare);
+    spare = next;
+  }
+
+  kmem_remote_drain(cache, pc);
+  while (pc->empty.head != NULL) {
+    kmem_slab_t *slab = pc->empty.head;
+    kmem_list_remove(&pc->empty, slab);
+    kmem_slab_release(cache, slab);
+  }
+  irq_restore(flags);
+}
+
+// Tear down a cache whose objects have all been freed. With more than one CPU
+// the others must have run kmem_cache_shrink on it first
+bool kmem_cache_destroy(kmem_cache_t *cache) {
+  uint32_t active = kmem_cache_active(cache);
+  if (active > 0) {
+    printf("SLAB: Can't destroy %s, %u objects still in use\n", cache->name,
+           active);
+    return false;
+  }
+  kmem_cache_shrink(cache);
+
+  uint32_t flags = irq_save();
+  spin_lock(&kmem_caches_lock);
+  kmem_cache_t **link = &kmem_caches;
+  while (*link != cache) {
+    link = &(*link)->next_cache;
+  }
+  *link = cache->next_cache;
+  spin_unlock(&kmem_caches_lock);
+  irq_restore(flags);
+
+  kmem_cache_free(&kmem_cache_cache, cache);
+  return true;
+}
+
+// Create a cache of size-byte objects aligned to align (0 for the default).
+// ctor, if given, runs once per object when its slab is created, not on
+// every allocation, so objects must be freed in their constructed state.
+// Returns NULL when out of memory.
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size,
+                                uint32_t align, kmem_ctor_t ctor) {
+  if (size == 0 || (align & (align - 1))) {
+    printf("SLAB: Bad size %u or alignment %u for %s\n", size, align, name);
+    return NULL;
+  }
+
+  kmem_cache_t *cache = kmem_cache_alloc(&kmem_cache_cache);
+  if (cache == NULL)
+    return NULL;
+
+  uint32_t flags = irq_save();
+  kmem_cache_setup(cache, name, size, align, ctor);
+  irq_restore(flags);
+
+  if (cache->objs_per_slab == 0) {
+    printf("SLAB: %s objects of %u bytes don't fit a slab\n", name, size);
+    kmem_cache_destroy(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+void kmem_print_stats(void) {
+  uint32_t flags = irq_save();
+  spin_lock(&kmem_caches_lock);
+  for (kmem_cache_t *c = kmem_caches; c != NULL; c = c->next_cache) {
+    uint32_t allocs = 0, hits = 0, remote = 0, slabs = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+      kmem_cpu_cache_t *pc = &c->cpu[cpu];
+      allocs += pc->allocs;
+      hits += pc->mag_hits;
+      remote += pc->remote_frees;
+      slabs += pc->full.count + pc->partial.count + pc->empty.count;
+    }
+    printf("SLAB: %s: %u B objects, %u active, %u slabs of %u KB, "
+           "%u allocs, %u magazine hits, %u depot exchanges, %u remote "
+           "frees\n",
+           c->name, c->obj_size, kmem_cache_active(c), slabs,
+           kmem_slab_bytes(c) / 1024, allocs, hits, c->depot_exchanges,
+           remote);
+  }
+  spin_unlock(&kmem_caches_lock);
+  irq_restore(flags);
+}
+
+// ============= kmalloc =============
+// General purpose allocations, served from one slab cache per size class:
+// the powers of two from 16 bytes to 8KB plus the half steps between them
+// (16, 24, 32, 48, ..., 6144, 8192). A request wastes at most a third of its
+// object, about a sixth on average. Everything above 8KB gets whole pages from
+// vma_alloc, and the region tree doubles as the table of their sizes, so no
+// allocation carries a header.
+//
+// All kmalloc caches use the same slab size, so kfree finds the cache of a
+// small object from its address alone. Large allocations live in the
+// vma_alloc range, slabs in the direct map below it.
+//
+// Power-of-two classes are aligned to their size, half steps to their lowest
+// set bit (24 to 8, 48 to 16, ...). Small allocations never touch a page
+// table: slabs come straight from the PFA through the direct map.
+
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 8192
+#define KMALLOC_CLASSES 19
+#define KMALLOC_SLAB_ORDER 4 // 64KB, 7 of the largest objects per slab
+#define KMALLOC_SLAB_BYTES (PAGE_SIZE << KMALLOC_SLAB_ORDER)
+
+static const uint32_t kmalloc_sizes[KMALLOC_CLASSES] = {
+    16,  24,  32,   48,   64,   96,   128,  192,  256, 384,
+    512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192};
+static const char *kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16",   "kmalloc-24",   "kmalloc-32",   "kmalloc-48",
+    "kmalloc-64",   "kmalloc-96",   "kmalloc-128",  "kmalloc-192",
+    "kmalloc-256",  "kmalloc-384",  "kmalloc-512",  "kmalloc-768",
+    "kmalloc-1024", "kmalloc-1536", "kmalloc-2048", "kmalloc-3072",
+    "kmalloc-4096", "kmalloc-6144", "kmalloc-8192"};
+static kmem_cache_t *kmalloc_caches[KMALLOC_CLASSES];
+
+// Statistics
+uint32_t kmalloc_large_allocs = 0;
+uint32_t kmalloc_large_pages = 0; // Currently held by large allocations
+
+// Size class for 1 <= size <= KMALLOC_MAX, no loops: 2^k sits at index
+// 2(k - 4), the half step 3 * 2^(k-2) just below it at 2(k - 4) - 1
+static inline uint32_t kmalloc_index(uint32_t size) {
+  if (size <= KMALLOC_MIN)
+    return 0;
+  uint32_t k = 32 - __builtin_clz(size - 1); // size <= 2^k
+  uint32_t index = 2 * (k - 4);
+  if (size <= 3u << (k - 2))
+    index--;
+  return index;
+}
+
+static inline bool kmalloc_is_large(const void *ptr) {
+  return (uintptr_t)ptr >= VMA_START && (uintptr_t)ptr < VMA_END;
+}
+
+static void *kmalloc_large(size_t size) {
+  uintptr_t virt = vma_alloc(kernel_page_directory, size, 0, 0);
+  if (virt == 0)
+    return NULL;
+  kmalloc_large_allocs++;
+  kmalloc_large_pages += CEIL_DIV(size, PAGE_SIZE);
+  return (void *)virt;
+}
+
+void *kmalloc(size_t size) {
+  if (size == 0)
+    return NULL;
+  if (size > KMALLOC_MAX)
+    return kmalloc_large(size);
+  return kmem_cache_alloc(kmalloc_caches[kmalloc_index(size)]);
+}
+
+// Usable size of an allocation, at least what was asked for. 0 for pointers
+// kmalloc didn't hand out (as far as it can tell)
+size_t ksize(const void *ptr) {
+  if (ptr == NULL)
+    return 0;
+
+  if (kmalloc_is_large(ptr)) {
+    vma_t *vma = vma_lookup((uintptr_t)ptr);
+    if (vma == NULL || vma->start != (uintptr_t)ptr)
+      return 0;
+    return vma->num_pages * PAGE_SIZE;
+  }
+
+  kmem_slab_t *slab = (kmem_slab_t *)((uintptr_t)ptr &
+                                      ~(uintptr_t)(KMALLOC_SLAB_BYTES - 1));
+  return slab->cache->obj_size;
+}
+
+void kfree(void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  if (kmalloc_is_large(ptr)) {
+    size_t size = ksize(ptr);
+    if (size == 0) {
+      printf("KMALLOC: Free of %p, not the start of an allocation\n", ptr);
+      return;
+    }
+    vma_free(kernel_page_directory, (uintptr_t)ptr, size);
+    kmalloc_large_pages -= size / PAGE_SIZE;
+    return;
+  }
+
+  kmem_slab_t *slab = (kmem_slab_t *)((uintptr_t)ptr &
+                                      ~(uintptr_t)(KMALLOC_SLAB_BYTES - 1));
+  kmem_cache_free(slab->cache, ptr);
+}
+
+// size bytes aligned to align (a power of two). Small ones come from the
+// power-of-two class covering both, which is naturally aligned; large ones
+// are page aligned, so align can't go past PAGE_SIZE there
+void *kmalloc_aligned(size_t size, uint32_t align) {
+  if (size == 0 || (align & (align - 1)))
+    return NULL;
+  if (align <= KMEM_MIN_ALIGN)
+    return kmalloc(size);
+
+  size_t need = size > align ? size : align;
+  if (need <= KMALLOC_MAX) {
+    uint32_t pow2 = 1u << (32 - __builtin_clz((uint32_t)need - 1));
+    if (pow2 < KMALLOC_MIN)
+      pow2 = KMALLOC_MIN;
+    return kmem_cache_alloc(kmalloc_caches[kmalloc_index(pow2)]);
+  }
+  if (align > PAGE_SIZE) {
+    printf("KMALLOC: Alignment %u too large for %u bytes\n", align,
+           (uint32_t)size);
+    return NULL;
+  }
+  return kmalloc_large(size);
+}
+
+// Resize an allocation, moving it if it no longer fits. Like realloc: NULL
+// allocates, size 0 frees, and on failure the old block stays valid. A moved
+// block comes from plain kmalloc, so the alignment of a kmalloc_aligned block
+// is not kept (shrinking it into a smaller class moves it too); reallocate
+// those with kmalloc_aligned and copy instead
+void *krealloc(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return kmalloc(size);
+  if (size == 0) {
+    kfree(ptr);
+    return NULL;
+  }
+
+  size_t old_size = ksize(ptr);
+  if (old_size == 0)
+    return NULL;
+
+  // Keep it where it is if it fits and doesn't shrink into a smaller class
+  // (or, for large ones, free up whole pages)
+  if (size <= old_size) {
+    bool same = kmalloc_is_large(ptr)
+                    ? CEIL_DIV(size, PAGE_SIZE) == old_size / PAGE_SIZE
+                    : kmalloc_sizes[kmalloc_index(size)] == old_size;
+    if (same)
+      return ptr;
+  }
+
+  void *new_ptr = kmalloc(size);
+  if (new_ptr == NULL)
+    return NULL;
+  memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+  kfree(ptr);
+  return new_ptr;
+}
+
+void kmalloc_print_stats(void) {
+  for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+    kmem_cache_t *c = kmalloc_caches[i];
+    uint32_t allocs = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+      allocs += c->cpu[cpu].allocs;
+    }
+    if (allocs > 0)
+      printf("KMALLOC: %s: %u active, %u allocs\n", c->name,
+             kmem_cache_active(c), allocs);
+  }
+  printf("KMALLOC: %u large allocations, %u pages held\n",
+         kmalloc_large_allocs, kmalloc_large_pages);
+}
+
+// Set up the cache of cache descriptors and the kmalloc size classes. Run
+// once the PFA, the direct map and vma_alloc are up
+void init_kalloc() {
+  kmem_cache_setup(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache_t),
+                   CACHE_LINE_SIZE, NULL);
+  kmem_cache_cache.magazines = false;
+
+  kmem_magazine_cache = kmem_cache_create(
+      "kmem_magazine", sizeof(kmem_magazine_t), CACHE_LINE_SIZE, NULL);
+  if (kmem_magazine_cache == NULL) {
+    printf("SLAB: Can't create the magazine cache\n");
+    return;
+  }
+  kmem_magazine_cache->magazines = false;
+
+  for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+    uint32_t size = kmalloc_sizes[i];
+    kmalloc_caches[i] =
+        kmem_cache_create(kmalloc_names[i], size, size & -size, NULL);
+    if (kmalloc_caches[i] == NULL) {
+      printf("KMALLOC: Can't create %s\n", kmalloc_names[i]);
+      return;
+    }
+    kmem_cache_set_order(kmalloc_caches[i], KMALLOC_SLAB_ORDER);
+  }
+
+  printf("SLAB: Initialized, %u kmalloc classes from %u to %u bytes\n",
+         KMALLOC_CLASSES, KMALLOC_MIN, KMALLOC_MAX);
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <memory/memory.h>
+#include <memory/paging.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <util/percpu.h>
+#include <util/printf.h>
+#include <util/util.h>
+
+// Short-lived kernel mappings of frames outside the direct map (high memory,
+// foreign page tables). Each CPU owns a ring of KMAP_SLOTS PTEs in the fixed
+// mapping PT and hands them out as a stack: kmap_atomic pushes, kunmap_atomic
+// pops the most recent mapping, so an interrupt handler can map and unmap on
+// top of whatever it interrupted.
+//
+// Unmapping only clears the PTE and marks the slot stale; its TLB entry may
+// linger because nothing touches that address again until the ring comes
+// back around. Only handing out a stale slot forces invalidation, and then
+// every stale slot is flushed in one batch, so a full lap of the ring costs a
+// single round of invlpgs (or one full flush) instead of one per unmap.
+#define KMAP_SLOTS 64        // Per CPU, must be a multiple of 32
+#define KMAP_FLUSH_ALL 16    // Stale slots at which a full flush is cheaper
+#define KMAP_FIRST_SLOT 0    // Fixed mapping PT index of CPU 0's first slot
+
+typedef struct {
+  uint8_t stack[KMAP_SLOTS]; // Slots of the live mappings, oldest first
+  uint32_t depth;
+  uint32_t next;                   // Ring index where the slot search starts
+  uint32_t live[KMAP_SLOTS / 32];  // Slots currently on the stack
+  uint32_t stale[KMAP_SLOTS / 32]; // Unmapped but possibly still in the TLB
+  uint32_t num_stale;
+
+  // Statistics
+  uint32_t maps;
+  uint32_t flushes;     // Batches of stale slots invalidated
+  uint32_t invlpgs;     // Single entries invalidated by those batches
+  uint32_t full_flushes; // Batches done with a full TLB flush
+} __cacheline_aligned kmap_cpu_t;
+
+static kmap_cpu_t kmap_cpu[MAX_CPUS];
+
+static inline uint32_t kmap_slot_index(uint32_t cpu, uint32_t slot) {
+  return KMAP_FIRST_SLOT + cpu * KMAP_SLOTS + slot;
+}
+
+static inline uintptr_t kmap_slot_addr(uint32_t cpu, uint32_t slot) {
+  return FIXMAP_BASE + kmap_slot_index(cpu, slot) * PAGE_SIZE;
+}
+
+static inline bool kmap_is_slot_addr(uintptr_t virt) {
+  return virt >= kmap_slot_addr(0, 0) &&
+         virt < kmap_slot_addr(MAX_CPUS, 0);
+}
+
+// Invalidate every stale slot of this CPU in one go
+static void kmap_flush_stale(kmap_cpu_t *km, uint32_t cpu) {
+  if (km->num_stale >= KMAP_FLUSH_ALL) {
+    flush_tlb_all(); // The slots are global, a CR3 reload would miss them
+    km->full_flushes++;
+  } else {
+    for (uint32_t w = 0; w < KMAP_SLOTS / 32; w++) {
+      uint32_t bits = km->stale[w];
+      while (bits) {
+        uint32_t bit = __builtin_ctz(bits);
+        bits &= bits - 1;
+        invlpg(kmap_slot_addr(cpu, w * 32 + bit));
+        km->invlpgs++;
+      }
+    }
+  }
+
+  for (uint32_t w = 0; w < KMAP_SLOTS / 32; w++) {
+    km->stale[w] = 0;
+  }
+  km->num_stale = 0;
+  km->flushes++;
+}
+
+// Map a frame for the caller's exclusive, short-term use and return its
+// address. Directly mapped frames are returned as is. Mappings must be
+// released with kunmap_atomic in reverse order. Returns NULL when all of this
+// CPU's slots are live (mapping nested too deep).
+void *kmap_atomic(phys_addr_t phys) {
+  if (phys_is_direct_mapped(phys))
+    return phys_to_virt(phys);
+
+  uint32_t flags = irq_save();
+  uint32_t cpu = cpu_id();
+  kmap_cpu_t *km = &kmap_cpu[cpu];
+
+  if (km->depth == KMAP_SLOTS) {
+    irq_restore(flags);
+    printf("KMAP: Out of slots on CPU %u\n", cpu);
+    return NULL;
+  }
+
+  // Skip slots still held further down the stack, one is always free
+  uint32_t slot = km->next;
+  while (km->live[slot / 32] & (1u << (slot % 32))) {
+    slot = (slot + 1) % KMAP_SLOTS;
+  }
+  if (km->stale[slot / 32] & (1u << (slot % 32))) {
+    kmap_flush_stale(km, cpu); // Ring came around, pay for the whole lap now
+  }
+
+  km->next = (slot + 1) % KMAP_SLOTS;
+  km->live[slot / 32] |= 1u << (slot % 32);
+  km->stack[km->depth++] = slot;
+  km->maps++;
+
+  // The slot is not present or was flushed above, so no invlpg here
+  set_pte(&kernel_page_table[kmap_slot_index(cpu, slot)],
+          (phys & PTE_ADDR_MASK) | pte_nx | pte_global |
+              3); // Present + writable
+
+  irq_restore(flags);
+  return (void *)kmap_slot_addr(cpu, slot);
+}
+
+// Release the most recent kmap_atomic mapping
+void kunmap_atomic(void *addr) {
+  uintptr_t virt = (uintptr_t)addr & ~(uintptr_t)(PAGE_SIZE - 1);
+  if (!kmap_is_slot_addr(virt))
+    return; // Direct map address, nothing was mapped
+
+  uint32_t flags = irq_save();
+  uint32_t cpu = cpu_id();
+  kmap_cpu_t *km = &kmap_cpu[cpu];
+
+  uint32_t top = km->depth > 0 ? km->stack[km->depth - 1] : 0;
+  if (km->depth == 0 || virt != kmap_slot_addr(cpu, top)) {
+    irq_restore(flags);
+    printf("KMAP: Unbalanced unmap of %p on CPU %u\n", virt, cpu);
+    return;
+  }
+
+  // Clear the PTE but leave the TLB alone, the slot is flushed before reuse
+  set_pte(&kernel_page_table[kmap_slot_index(cpu, top)], 0);
+  km->live[top / 32] &= ~(1u << (top % 32));
+  km->stale[top / 32] |= 1u << (top % 32);
+  km->num_stale++;
+  km->depth--;
+
+  irq_restore(flags);
+}
+
+void kmap_print_stats(void) {
+  for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    kmap_cpu_t *km = &kmap_cpu[cpu];
+    printf("KMAP: CPU %u: %u maps, %u live, %u stale, %u flushes (%u invlpg, "
+           "%u full)\n",
+           cpu, km->maps, km->depth, km->num_stale, km->flushes, km->invlpgs,
+           km->full_flushes);
+  }
+}
@@ -0,0 +1,256 @@
+#pragma once
+#include <memory/memory.h>
+#include <memory/multiboot_gnu.h>
+#include <memory/paging.h>
+#include <memory/pfa_helpers.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <util/printf.h>
+#include <util/util.h>
+
+// Early boot range allocator (memblock). Before the PFA exists there is no
+// frame allocator to place its own bitmap or the buddy bitmaps in, so they
+// used to be static arrays sized for the largest machine the kernel can track.
+// memblock fills that gap with two sorted lists of physical ranges: memory
+// (usable RAM from the multiboot map) and reserved (firmware areas, the kernel
+// image, multiboot data, and everything memblock_alloc handed out).
+//
+//   memblock_init(mbi);
+//   phys_addr_t table = memblock_alloc(bytes, PAGE_SIZE);
+//   ... memory minus reserved seeds the PFA ...
+//   memblock_retire();
+//
+// Everything is tracked in whole frames, so a reserved range never shares a
+// frame with memory the PFA may give out (or the boot reclaim pass may free).
+// Allocations go top-down below direct_map_end: before init_direct_map that is
+// the 4MB boot.nasm maps, so the result is usable through phys_to_virt right
+// away.
+
+// Linker symbols for kernel physical range (add these to link.ld as extern)
+extern char kernel_physical_start[];
+extern char kernel_physical_end[];
+extern char kernel_virtual_end[];
+
+#define MEMBLOCK_MAX_REGIONS 32
+
+// 64-bit even without PAE, so a region can end at 4GB
+typedef struct {
+  uint64_t base;
+  uint64_t end; // Exclusive
+} memblock_region_t;
+
+typedef struct {
+  const char *name;
+  memblock_region_t regions[MEMBLOCK_MAX_REGIONS]; // Sorted, never touching
+  uint32_t count;
+} memblock_type_t;
+
+memblock_type_t memblock_memory = {"memory", {{0, 0}}, 0};
+memblock_type_t memblock_reserved = {"reserved", {{0, 0}}, 0};
+
+uint32_t memblock_allocated = 0; // Bytes handed out by memblock_alloc
+bool memblock_retired = false;   // The PFA owns physical memory now
+
+static inline uint64_t memblock_page_down(uint64_t addr) {
+  return addr & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+static inline uint64_t memblock_page_up(uint64_t addr) {
+  return memblock_page_down(addr + PAGE_SIZE - 1);
+}
+
+// Add [base, end) to a list, merging it with every region it overlaps or
+// touches. Returns false when the list is full and the range was dropped
+static bool memblock_insert(memblock_type_t *type, uint64_t base,
+                            uint64_t end) {
+  if (base >= end)
+    return true;
+
+  // First region that ends at or after base, then every one starting before
+  // end: those get absorbed
+  uint32_t first = 0;
+  while (first < type->count && type->regions[first].end < base)
+    first++;
+  uint32_t last = first;
+  while (last < type->count && type->regions[last].base <= end) {
+    if (type->regions[last].base < base)
+      base = type->regions[last].base;
+    if (type->regions[last].end > end)
+      end = type->regions[last].end;
+    last++;
+  }
+
+  uint32_t absorbed = last - first;
+  if (absorbed == 0) {
+    if (type->count == MEMBLOCK_MAX_REGIONS) {
+      printf("MEMBLOCK: Too many %s regions, dropped 0x%x-0x%x\n", type->name,
+             (uint32_t)base, (uint32_t)end);
+      return false;
+    }
+    for (uint32_t i = type->count; i > first; i--)
+      type->regions[i] = type->regions[i - 1];
+    type->count++;
+  } else {
+    for (uint32_t i = last; i < type->count; i++)
+      type->regions[i - absorbed + 1] = type->regions[i];
+    type->count -= absorbed - 1;
+  }
+
+  type->regions[first].base = base;
+  type->regions[first].end = end;
+  return true;
+}
+
+// Usable RAM. Partial frames at either end are not usable
+void memblock_add(uint64_t base, uint64_t size) {
+  memblock_insert(&memblock_memory, memblock_page_up(base),
+                  memblock_page_down(base + size));
+}
+
+// Keep [base, base + size) away from memblock_alloc and the PFA. Partial
+// frames at either end are reserved whole
+void memblock_reserve(uint64_t base, uint64_t size) {
+  memblock_insert(&memblock_reserved, memblock_page_down(base),
+                  memblock_page_up(base + size));
+}
+
+// Lowest reserved region overlapping [base, end), or NULL
+static memblock_region_t *memblock_find_reserved(uint64_t base,
+                                                 uint64_t end) {
+  for (uint32_t i = 0; i < memblock_reserved.count; i++) {
+    memblock_region_t *r = &memblock_reserved.regions[i];
+    if (r->base >= end)
+      break;
+    if (r->end > base)
+      return r;
+  }
+  return NULL;
+}
+
+// size bytes of free RAM, aligned to align (a power of two, at least a frame),
+// reserved for good. Returns the physical address, or 0 when nothing below
+// direct_map_end fits (frame 0 is never handed out)
+phys_addr_t memblock_alloc(uint32_t size, uint32_t align) {
+  if (memblock_retired) {
+    printf("MEMBLOCK: Allocation after the PFA took over\n");
+    return 0;
+  }
+  if (align < PAGE_SIZE)
+    align = PAGE_SIZE;
+  size = (uint32_t)memblock_page_up(size);
+  if (size == 0)
+    return 0;
+
+  // Top-down, so the low frames stay free for DMA-limited users
+  for (uint32_t i = memblock_memory.count; i-- > 0;) {
+    uint64_t lo = memblock_memory.regions[i].base;
+    uint64_t hi = memblock_memory.regions[i].end;
+    if (hi > direct_map_end)
+      hi = direct_map_end;
+
+    while (hi > lo && hi - lo >= size) {
+      uint64_t candidate = (hi - size) & ~(uint64_t)(align - 1);
+      if (candidate < lo)
+        break;
+
+      // Below the lowest reservation in the way, anything higher overlaps it
+      memblock_region_t *taken =
+          memblock_find_reserved(candidate, candidate + size);
+      if (taken == NULL) {
+        // Unrecorded, the PFA would hand the range out again
+        if (!memblock_insert(&memblock_reserved, candidate, candidate + size))
+          return 0;
+        memblock_allocated += size;
+        return (phys_addr_t)candidate;
+      }
+      hi = taken->base;
+    }
+  }
+
+  printf("MEMBLOCK: Out of memory for %u KB below 0x%x\n",
+         size / 1024, (uint32_t)direct_map_end);
+  return 0;
+}
+
+// Seed memblock from the multiboot memory map and reserve everything that is
+// already in use: firmware areas, the kernel image and the multiboot data
+void memblock_init(multiboot_info_t *mbi) {
+  if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+    multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)mbi->mmap_addr;
+    uintptr_t mmap_end = mbi->mmap_addr + mbi->mmap_length;
+
+    while ((uintptr_t)mmap < mmap_end) {
+      // Only memory the PFA can track (4GB, 16GB with PAE)
+      if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE &&
+          mmap->addr < PFA_MAX_PHYS_ADDR) {
+        uint64_t end = mmap->addr + mmap->len;
+        if (end > PFA_MAX_PHYS_ADDR)
+          end = PFA_MAX_PHYS_ADDR;
+        memblock_add(mmap->addr, end - mmap->addr);
+      }
+
+      mmap = (multiboot_memory_map_t *)((uintptr_t)mmap + mmap->size +
+                                        sizeof(mmap->size));
+    }
+  }
+
+  // NULL guard page (also the real mode IVT and BIOS data area), then the
+  // EBDA, VGA memory and BIOS ROM up to 1MB. The map usually lists the latter
+  // as reserved already, but be explicit
+  memblock_reserve(0, PAGE_SIZE);
+  memblock_reserve(0x9F000, 0x100000 - 0x9F000);
+
+  // The kernel image. kernel_physical_end only marks the end of the
+  // low-linked bootstrap part, the higher-half sections (and their .bss)
+  // follow it, so use the end of the whole image
+  uintptr_t kernel_start = (uintptr_t)&kernel_physical_start;
+  uintptr_t kernel_end = (uintptr_t)&kernel_virtual_end - KERNEL_VIRTUAL_BASE;
+  memblock_reserve(kernel_start, kernel_end - kernel_start);
+
+  // Multiboot info (mbi is a higher-half pointer, see boot.nasm), memory map,
+  // command line and modules. The boot reclaim pass frees them again
+  memblock_reserve((uintptr_t)mbi - KERNEL_VIRTUAL_BASE, sizeof(*mbi));
+  if (mbi->flags & MULTIBOOT_INFO_MEM_MAP)
+    memblock_reserve(mbi->mmap_addr, mbi->mmap_length);
+  if (mbi->flags & MULTIBOOT_INFO_CMDLINE)
+    memblock_reserve(mbi->cmdline, 1);
+  if (mbi->flags & MULTIBOOT_INFO_MODS && mbi->mods_count > 0) {
+    multiboot_module_t *mod = (multiboot_module_t *)mbi->mods_addr;
+    memblock_reserve(mbi->mods_addr, mbi->mods_count * sizeof(*mod));
+    for (uint32_t i = 0; i < mbi->mods_count; i++) {
+      memblock_reserve(mod[i].mod_start, mod[i].mod_end - mod[i].mod_start);
+      printf("  - Reserved module %u: 0x%x-0x%x\n", i, mod[i].mod_start,
+             mod[i].mod_end);
+    }
+  }
+
+  printf("MEMBLOCK: %u memory and %u reserved regions, kernel at 0x%x-0x%x\n",
+         memblock_memory.count, memblock_reserved.count, kernel_start,
+         kernel_end);
+}
+
+// The PFA has taken over whatever memblock did not hand out
+void memblock_retire(void) { memblock_retired = true; }
+
+static uint64_t memblock_total(const memblock_type_t *type) {
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < type->count; i++)
+    total += type->regions[i].end - type->regions[i].base;
+  return total;
+}
+
+void memblock_print_stats(void) {
+  printf("MEMBLOCK: %u KB of RAM in %u regions, %u KB reserved, %u KB "
+         "allocated\n",
+         (uint32_t)(memblock_total(&memblock_memory) / 1024),
+         memblock_memory.count,
+         (uint32_t)(memblock_total(&memblock_reserved) / 1024),
+         memblock_allocated / 1024);
+  if (PRINT_MEMORY_MAP) {
+    for (uint32_t i = 0; i < memblock_reserved.count; i++) {
+      printf("  - Reserved: 0x%x-0x%x\n",
+             (uint32_t)memblock_reserved.regions[i].base,
+             (uint32_t)memblock_reserved.regions[i].end);
+    }
+  }
+}
@@ -1,29 +1,198 @@
 #pragma once
 #include <stdbool.h>
 #include <stddef.h> // For size_t
+#include <memory/paging.h>
 #include <stdint.h> // For uint32_t, uintptr_t
+#include <util/cpu.h>
+#include <util/percpu.h>
 #include <util/printf.h>
+#include <util/util.h>
 
-#define PDE_COUNT 1024 // Fixed for 32-bit x86
-
-#define PAGE_SIZE 4096
-#define TEMP_MAP_ADDR                                                          \
-  0xC03FF000 // As per book: Last entry in kernel's first PT (PDE 768, PTE 1023)
-// #define TEMP_MAP_ADDR_BITSHIFT (768 << 22) | (1023 << 12) | 0x000
 #define BITS_PER_BYTE 8
 
 #define B_TO_KB(num) ((unsigned long long)(num) / (1ULL << 10))
 #define B_TO_MB(num) ((unsigned long long)(num) / (1ULL << 20))
 #define B_TO_GB(num) ((unsigned long long)(num) / (1ULL << 30))
 
-extern uint32_t page_directory[1024];
+extern pte_t page_directory[NUM_PDES];
+extern pte_t page_table[PAGES_PER_PT]; // Fixed mapping PT at FIXMAP_BASE
+
+#define KERNEL_VIRTUAL_BASE 0xC0000000
+// page_directory and page_table are linked low (boot.nasm uses them before
+// paging is on), so their symbols are physical addresses that only resolve
+// through the boot identity map. These are their higher-half aliases, which
+// keep working after the identity map is reclaimed.
+#define kernel_page_directory                                                  \
+  ((pte_t *)((uintptr_t)page_directory + KERNEL_VIRTUAL_BASE))
+#define kernel_page_table                                                      \
+  ((pte_t *)((uintptr_t)page_table + KERNEL_VIRTUAL_BASE))
 
 // Enable recursive mapping (do this once, after PD is initialized)
 void setup_recursive_pd() {
-  // Set last PDE to point to PD itself (Present + R/W)
-  page_directory[1023] = page_directory[0] | 3; // 3 = 0b11 (Present + Write)
+  // Point the last PDEs at the page directories themselves (Present + R/W),
+  // one per directory. page_directory is linked low, so its address is
+  // already the physical one
+  for (uint32_t i = 0; i < RECURSIVE_PDES; i++) {
+    set_pte(&kernel_page_directory[NUM_PDES - RECURSIVE_PDES + i],
+            ((uint32_t)page_directory + i * PAGE_SIZE) |
+                3); // 3 = 0b11 (Present + Write)
+  }
   // Flush TLB to apply changes
-  asm volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax");
+  flush_tlb();
+}
+
+// ============= Direct Map =============
+// Physical end of the direct map. Until init_direct_map runs only the boot
+// mapping of the first 4MB exists
+phys_addr_t direct_map_end = BOOT_MAP_SIZE;
+
+static inline bool phys_is_direct_mapped(phys_addr_t phys) {
+  return phys < direct_map_end;
+}
+
+// Kernel pointer to a directly mapped frame, no mapping or TLB work involved
+static inline void *phys_to_virt(phys_addr_t phys) {
+  return (void *)(uintptr_t)(phys + DIRECT_MAP_BASE);
+}
+
+// Physical address behind a direct map (or kernel image) pointer
+static inline phys_addr_t virt_to_phys(const void *virt) {
+  return (phys_addr_t)((uintptr_t)virt - DIRECT_MAP_BASE);
+}
+
+// No-execute bit for data mappings, 0 when the CPU or paging mode lacks it
+pte_t pte_nx = 0;
+
+// NX is bit 63 of an entry, so it only exists with PAE, and it has to be
+// switched on in EFER before any entry may set it (the bit is reserved
+// otherwise and faults)
+void setup_nx() {
+#ifdef CONFIG_PAE
+  if (cpuid(CPUID_EXT_MAX).eax < CPUID_EXT_INFO ||
+      !(cpuid(CPUID_EXT_INFO).edx & CPUID_EXT_EDX_NX)) {
+    printf("PAGING: PAE, no NX support\n");
+    return;
+  }
+
+  wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+  pte_nx = 1ULL << 63;
+  printf("PAGING: PAE with NX enabled\n");
+#endif
+}
+
+// Global bit for kernel mappings, 0 when the CPU lacks PGE
+pte_t pte_global = 0;
+bool pge_enabled = false;
+
+// The kernel half is the same in every address space, so its translations can
+// be global and survive the CR3 reload of an address space switch. Marks what
+// is mapped there so far (the boot mapping of the kernel image and the fixed
+// mapping PT) global and turns CR4.PGE on. The recursive PDEs stay non-global,
+// they differ per page directory. Run before init_direct_map and init_vma so
+// their mappings pick up pte_global.
+void setup_pge() {
+  if (!(cpuid(CPUID_FEATURES).edx & CPUID_EDX_PGE)) {
+    printf("PAGING: No PGE support\n");
+    return;
+  }
+
+  pte_global = PTE_GLOBAL;
+  for (uint32_t i = PDE_INDEX(DIRECT_MAP_BASE); i < NUM_PDES - RECURSIVE_PDES;
+       i++) {
+    pte_t *pde = &kernel_page_directory[i];
+    if ((*pde & 1) && (*pde & PDE_PS))
+      set_pte(pde, *pde | PTE_GLOBAL); // The G bit of a PT pointer is ignored
+  }
+  for (uint32_t i = 0; i < PAGES_PER_PT; i++) {
+    if (kernel_page_table[i] & 1)
+      set_pte(&kernel_page_table[i], kernel_page_table[i] | PTE_GLOBAL);
+  }
+
+  // Setting CR4.PGE flushes the whole TLB, so the new bits apply right away
+  write_cr4(read_cr4() | CR4_PGE);
+  pge_enabled = true;
+  printf("PAGING: Global kernel pages enabled\n");
+}
+
+// Drop every TLB entry, global ones included. A CR3 reload (flush_tlb) keeps
+// global entries, toggling CR4.PGE drops them too
+void flush_tlb_all() {
+  if (!pge_enabled) {
+    flush_tlb();
+    return;
+  }
+
+  uint32_t cr4 = read_cr4();
+  write_cr4(cr4 & ~CR4_PGE);
+  write_cr4(cr4);
+}
+
+// Page attribute table: the PAT, PCD and PWT bits of an entry pick one of
+// eight memory types from IA32_PAT. Entries 0-3 keep their power-on types,
+// so PCD/PWT alone still mean what they always did, and entry 4 (PAT bit
+// alone) is turned into write-combining.
+#define PAT_UC 0x00 // Uncacheable
+#define PAT_WC 0x01 // Write-combining
+#define PAT_WT 0x04 // Write-through
+#define PAT_WB 0x06 // Write-back
+#define PAT_UC_MINUS 0x07 // Uncacheable, unless an MTRR says WC
+#define PAT_ENTRY(index, type) ((uint64_t)(type) << ((index) * 8))
+#define PAT_VALUE                                                              \
+  (PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WT) | PAT_ENTRY(2, PAT_UC_MINUS) |  \
+   PAT_ENTRY(3, PAT_UC) | PAT_ENTRY(4, PAT_WC) | PAT_ENTRY(5, PAT_WT) |        \
+   PAT_ENTRY(6, PAT_UC_MINUS) | PAT_ENTRY(7, PAT_UC))
+
+// PTE bits selecting write-combining. Without PAT it falls back to uncached,
+// which is what device memory gets anyway
+pte_t pte_wc = PTE_PCD | PTE_PWT;
+
+// Intel's sequence for changing memory types (SDM 11.12.4): caches off and
+// flushed, TLB flushed, then the new PAT, then flush both again before the
+// caches come back on. Run after setup_pge, so the flushes also catch global
+// entries
+void setup_pat() {
+  if (!(cpuid(CPUID_FEATURES).edx & CPUID_EDX_PAT)) {
+    printf("PAGING: No PAT support, write-combining maps uncached\n");
+    return;
+  }
+
+  uint32_t flags = irq_save();
+  uint32_t cr0 = read_cr0();
+  write_cr0((cr0 | CR0_CD) & ~CR0_NW);
+  wbinvd();
+  flush_tlb_all();
+  wrmsr(MSR_PAT, PAT_VALUE);
+  wbinvd();
+  flush_tlb_all();
+  write_cr0(cr0);
+  irq_restore(flags);
+  pte_wc = PTE_PAT;
+  printf("PAGING: PAT programmed, write-combining available\n");
+}
+
+// Map low physical memory at DIRECT_MAP_BASE with large pages, up to the end
+// of RAM or of the window, whichever comes first. The PDEs were not present
+// before, so nothing needs invalidating. The boot mapping of the kernel image
+// is kept as is, everything past it is data and gets NX (run after setup_nx
+// and setup_pge).
+void init_direct_map(uint64_t max_phys_addr) {
+  uint64_t end = max_phys_addr;
+  if (end > DIRECT_MAP_SIZE) {
+    end = DIRECT_MAP_SIZE;
+  }
+  end = CEIL_DIV(end, LARGE_PAGE_SIZE) * LARGE_PAGE_SIZE;
+
+  for (uint32_t phys = 0; phys < end; phys += LARGE_PAGE_SIZE) {
+    pte_t *pde = &kernel_page_directory[PDE_INDEX(DIRECT_MAP_BASE + phys)];
+    if (*pde & 1)
+      continue; // Boot mapping
+
+    set_pte(pde, phys | pte_nx | pte_global | PDE_PS | 3); // PS + Present + R/W
+  }
+
+  direct_map_end = end;
+  printf("PAGING: Direct map of %u MB at %p\n", (uint32_t)B_TO_MB(end),
+         DIRECT_MAP_BASE);
 }
 
 typedef struct {
@@ -31,18 +200,18 @@ typedef struct {
   uint32_t end;
 } pde_range_t;
 
-bool is_pde_free(uint32_t pde) {
+bool is_pde_free(pte_t pde) {
   return (pde & 1) == 0; // Bit 0 is the Present flag
 }
 
-size_t count_free_pdes(const uint32_t *pd) {
+size_t count_free_pdes(const pte_t *pd) {
   if (pd == NULL) {
     printf("Error: NULL page directory\n");
     return 0;
   }
 
   size_t free_count = 0;
-  for (size_t i = 0; i < PDE_COUNT; ++i) {
+  for (size_t i = 0; i < NUM_PDES; ++i) {
     if (is_pde_free(pd[i])) {
       ++free_count;
     }
@@ -51,13 +220,13 @@ size_t count_free_pdes(const uint32_t *pd) {
   return free_count;
 }
 
-int find_first_free_pde(const uint32_t *pd) {
+int find_first_free_pde(const pte_t *pd) {
   if (pd == NULL) {
     printf("Error: NULL page directory\n");
     return -1;
   }
 
-  for (int i = 0; i < PDE_COUNT; ++i) {
+  for (int i = 0; i < NUM_PDES; ++i) {
     if (is_pde_free(pd[i])) {
       return i;
     }
@@ -66,7 +235,7 @@ int find_first_free_pde(const uint32_t *pd) {
   return -1; // No free PDEs
 }
 
-size_t collect_free_pde_ranges(const uint32_t *pd, pde_range_t *ranges,
+size_t collect_free_pde_ranges(const pte_t *pd, pde_range_t *ranges,
                                size_t max_ranges) {
   if (pd == NULL || ranges == NULL || max_ranges == 0) {
     printf("Error: Invalid arguments for collect_free_pde_ranges\n");
@@ -76,7 +245,7 @@ size_t collect_free_pde_ranges(const uint32_t *pd, pde_range_t *ranges,
   size_t range_count = 0;
   int start = -1;
 
-  for (size_t i = 0; i < PDE_COUNT; ++i) {
+  for (size_t i = 0; i < NUM_PDES; ++i) {
     if (is_pde_free(pd[i])) {
       if (start == -1) {
         start = (int)i; // Start of a new range
@@ -99,31 +268,31 @@ size_t collect_free_pde_ranges(const uint32_t *pd, pde_range_t *ranges,
   // Handle trailing range if any
   if (start != -1 && range_count < max_ranges) {
     ranges[range_count].start = (uint32_t)start;
-    ranges[range_count].end = PDE_COUNT - 1;
+    ranges[range_count].end = NUM_PDES - 1;
     ++range_count;
   }
 
   return range_count;
 }
 
-void print_pde_summary(const uint32_t *pd) {
+void print_pde_summary(const pte_t *pd) {
   if (pd == NULL) {
     printf("Error: NULL page directory\n");
     return;
   }
 
   size_t free_count = count_free_pdes(pd);
-  size_t used_count = PDE_COUNT - free_count;
+  size_t used_count = NUM_PDES - free_count;
 
   printf("PDE Summary:\n");
-  printf("  Total PDEs: %u\n", PDE_COUNT);
+  printf("  Total PDEs: %u\n", NUM_PDES);
   printf("  Used PDEs: %u\n", used_count);
   printf("  Free PDEs: %u\n", free_count);
 
   // Collect and print free ranges (allocate temp buffer; adjust size if needed)
-  pde_range_t
-      ranges[512]; // Enough for worst-case fragmentation (every other PDE free)
-  size_t range_count = collect_free_pde_ranges(pd, ranges, 512);
+  pde_range_t ranges[NUM_PDES / 2]; // Enough for worst-case fragmentation
+                                    // (every other PDE free)
+  size_t range_count = collect_free_pde_ranges(pd, ranges, NUM_PDES / 2);
 
   if (range_count == 0) {
     printf("  Free Ranges: None\n");
@@ -140,7 +309,7 @@ void print_pde_summary(const uint32_t *pd) {
   }
 }
 
-int scan_pde_for_free(const uint32_t *pd, bool print_summary) {
+int scan_pde_for_free(const pte_t *pd, bool print_summary) {
   if (pd == NULL) {
     printf("Error: NULL page directory\n");
     return -1;
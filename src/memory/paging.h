@@ -0,0 +1,98 @@
+#pragma once
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+
+// Paging geometry. The default is classic 32-bit paging: 1024 4-byte entries
+// per table, so a PDE covers 4MB. Building with CONFIG_PAE (make PAE=1)
+// switches to PAE: 512 8-byte entries per table, a PDE covers 2MB and four
+// page directories hang off a 4-entry PDPT. Entries then hold physical
+// addresses past 4GB, and bit 63 becomes the no-execute bit.
+//
+// Either way the page directories are one flat array of NUM_PDES entries
+// indexed by virt >> PDE_SHIFT (the four PAE directories are physically
+// contiguous), so code that walks the tables doesn't care which mode is on.
+#ifdef CONFIG_PAE
+typedef uint64_t pte_t;       // Page table or page directory entry
+typedef uint64_t phys_addr_t; // Physical address, may be above 4GB
+#define PDE_SHIFT 21
+#define PAGES_PER_PT 512 // 512 PTEs per PT (2MB)
+#define NUM_PDES 2048    // 4 PDs x 512 PDEs (4GB)
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+#define PFA_MAX_FRAMES (1 << 22) // Physical memory tracked by the PFA (16GB)
+#else
+typedef uint32_t pte_t;
+typedef uint32_t phys_addr_t;
+#define PDE_SHIFT 22
+#define PAGES_PER_PT 1024 // 1024 PTEs per PT (4MB)
+#define NUM_PDES 1024     // 1024 PDEs in PD (4GB)
+#define PTE_ADDR_MASK 0xFFFFF000
+#define PFA_MAX_FRAMES (1 << 20) // 4GB
+#endif
+
+#define PFA_MAX_PHYS_ADDR ((uint64_t)PFA_MAX_FRAMES * PAGE_SIZE)
+
+#define LARGE_PAGE_SIZE (1u << PDE_SHIFT) // One PDE with PS set, no PT
+#define LARGE_PAGE_ORDER (PDE_SHIFT - 12) // Buddy order of a large page
+// Entry bits, the same in PTEs and PDEs unless noted
+#define PTE_PRESENT (1 << 0)
+#define PTE_WRITE (1 << 1)
+#define PTE_USER (1 << 2) // Ring 3 may access it (needs the PDE bit too)
+#define PTE_PWT (1 << 3)  // Write-through
+#define PTE_PCD (1 << 4)  // Cache disable
+#define PDE_PS (1 << 7)
+#define PTE_PAT (1 << 7) // Third PAT index bit, in a 4KB PTE
+#define PTE_GLOBAL (1 << 8) // Survives CR3 reloads (PTEs and PS PDEs only)
+#define PDE_PAT (1 << 12)   // Third PAT index bit, in a PS PDE
+
+// Page fault error code bits
+#define PF_PRESENT (1 << 0) // Protection violation, not a missing page
+#define PF_WRITE (1 << 1)
+#define PF_USER (1 << 2)
+
+#define PDE_INDEX(virt) ((uint32_t)(virt) >> PDE_SHIFT)
+#define PTE_INDEX(virt) (((uint32_t)(virt) >> 12) & (PAGES_PER_PT - 1))
+
+// Recursive mapping: the last RECURSIVE_PDES PDEs point back at the page
+// directories, which makes the PT of PDE i visible at GET_PT(i) and the flat
+// page directory itself at PD_VADDR. The PT for fixed mappings sits at
+// FIXMAP_PDE, just below the recursive window.
+#ifdef CONFIG_PAE
+#define RECURSIVE_PDES 4
+#define PT_BASE_VADDR 0xFF800000
+#define PD_VADDR 0xFFFFC000
+#define FIXMAP_PDE 2043 // 0xFF600000
+#else
+#define RECURSIVE_PDES 1
+#define PT_BASE_VADDR 0xFFC00000
+#define PD_VADDR 0xFFFFF000
+#define FIXMAP_PDE 1022 // 0xFF800000
+#endif
+
+// Low physical memory is mapped linearly at DIRECT_MAP_BASE, right where the
+// kernel image already lives (phys + 0xC0000000), up to the start of the
+// vma_alloc range. Frames in there never need a temporary mapping.
+#define DIRECT_MAP_BASE 0xC0000000
+#define DIRECT_MAP_SIZE 0x30000000 // 768 MB
+#define BOOT_MAP_SIZE 0x400000     // What boot.nasm maps before paging is on
+
+#define GET_PT(pde_index) (PT_BASE_VADDR + ((pde_index) << 12))
+#define FIXMAP_BASE ((uint32_t)FIXMAP_PDE << PDE_SHIFT)
+
+// Write a page table entry. A PAE entry takes two 32-bit stores, so the half
+// holding the present bit goes last when mapping and first when unmapping,
+// and the MMU never sees a present, half-written entry.
+static inline void set_pte(pte_t *entry, pte_t value) {
+#ifdef CONFIG_PAE
+  volatile uint32_t *half = (volatile uint32_t *)entry;
+  if (value & 1) {
+    half[1] = (uint32_t)(value >> 32);
+    half[0] = (uint32_t)value;
+  } else {
+    half[0] = (uint32_t)value;
+    half[1] = (uint32_t)(value >> 32);
+  }
+#else
+  *entry = value;
+#endif
+}
@@ -1,183 +1,103 @@
 #pragma once
+#include <memory/buddy.h>
+#include <memory/kmap.h>
+#include <memory/memblock.h>
 #include <memory/memory.h>
 #include <memory/multiboot_gnu.h>
 #include <memory/pfa_helpers.h>
+#include <memory/zone.h>
 #include <stdint.h>
 #include <util/bitmap.h>
+#include <util/percpu.h>
 #include <util/printf.h>
 #include <util/util.h>
 
-// Access boot.nasm structures
-extern uint32_t page_directory[1024];
-extern uint32_t
-    page_table[1024]; // Kernel's initial PT (maps 0xC0000000 - 0xC0400000)
-
-// Linker symbols for kernel physical range (add these to link.ld as extern)
-extern char kernel_physical_start[];
-extern char kernel_physical_end[];
-extern uintptr_t physical_bitmap;
-
 vm_bitmap_t vm_bitmap = {NULL, 0, 0, 0, 0};
 
+#define PFA_FRAMES_PER_WORD 32
+
 // ============= PFA Initialization Steps =============
 
-// Step 1: Initialize bitmap with all memory marked as used
-static void pfa_init_bitmap(uint32_t num_frames) {
-  vm_bitmap.bitmap_size = (num_frames + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
-  vm_bitmap.bitmap = (uint8_t *)&physical_bitmap;
+// Step 2a: Place the bitmap, sized for the frames actually installed, and mark
+// everything as used
+static bool pfa_init_bitmap(uint32_t num_frames) {
+  // Round up to whole 32-bit words, the allocator scans the bitmap word-wise
+  vm_bitmap.bitmap_size =
+      CEIL_DIV(num_frames, PFA_FRAMES_PER_WORD) * sizeof(uint32_t);
+  phys_addr_t phys = memblock_alloc(vm_bitmap.bitmap_size, PAGE_SIZE);
+  if (phys == 0)
+    return false;
+  vm_bitmap.bitmap = (uint8_t *)phys_to_virt(phys);
 
   // Initially mark everything as used (safer default)
   memset(vm_bitmap.bitmap, 0xFF, vm_bitmap.bitmap_size);
 
-  printf("PFA: Initialized bitmap for %u frames (%u KB bitmap)\n", num_frames,
-         vm_bitmap.bitmap_size / 1024);
-}
-
-// Step 2: Mark usable memory regions as free based on memory map
-static void pfa_mark_usable_memory(multiboot_info_t *mbi) {
-  multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)mbi->mmap_addr;
-  uintptr_t mmap_end = mbi->mmap_addr + mbi->mmap_length;
-  uint32_t usable_regions = 0;
-
-  printf("PFA: Processing memory map...\n");
-
-  while ((uintptr_t)mmap < mmap_end) {
-    if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
-      uint64_t base = mmap->addr;
-      uint64_t length = mmap->len;
-
-      // Only process memory below 4GB for 32-bit kernel
-      if (base < 0x100000000ULL) {
-        if (base + length > 0x100000000ULL) {
-          length = 0x100000000ULL - base; // Truncate at 4GB
-        }
-
-        uint32_t start_frame = base / PAGE_SIZE;
-        uint32_t num_frames = length / PAGE_SIZE;
-
-        bitmap_mark_range_free(&vm_bitmap, start_frame, num_frames);
-        usable_regions++;
-
-        printf("  - Marked free: frames %u-%u (0x%x-0x%x)\n", start_frame,
-               start_frame + num_frames - 1, (uint32_t)base,
-               (uint32_t)(base + length - 1));
-      }
-    }
-
-    mmap = (multiboot_memory_map_t *)((uintptr_t)mmap + mmap->size +
-                                      sizeof(mmap->size));
-  }
-
-  printf("PFA: Marked %u usable regions as free\n", usable_regions);
+  printf("PFA: Initialized bitmap for %u frames (%u KB bitmap at 0x%x)\n",
+         num_frames, CEIL_DIV(vm_bitmap.bitmap_size, 1024), (uint32_t)phys);
+  return true;
 }
 
-// Step 3: Mark critical system areas as used
-static void pfa_reserve_system_areas(void) {
-  if (PRINT_MEMORY_MAP)
-    printf("PFA: Reserving system areas...\n");
-
-  // 1. Reserve NULL page (frame 0) - catch null pointer dereferences
-  bitmap_set(vm_bitmap.bitmap, 0);
-  if (PRINT_MEMORY_MAP)
-    printf("  - Reserved: Frame 0 (NULL guard page)\n");
-
-  // 2. Reserve BIOS data area (0x400-0x4FF)
-  bitmap_set(vm_bitmap.bitmap, 0); // Frame 0 covers 0x0-0xFFF
-  if (PRINT_MEMORY_MAP)
-    printf("  - Reserved: BIOS IVT and data area\n");
-
-  // 3. Reserve EBDA (typically at 0x9FC00 or 0x80000)
-  // Usually already marked as reserved in memory map, but be explicit
-  uint32_t ebda_frame = 0x9F000 / PAGE_SIZE;          // Typical EBDA location
-  bitmap_mark_range_used(&vm_bitmap, ebda_frame, 16); // Reserve 64KB to be safe
-  if (PRINT_MEMORY_MAP)
-    printf("  - Reserved: Extended BIOS Data Area\n");
-
-  // 4. Reserve VGA memory (0xA0000-0xBFFFF)
-  uint32_t vga_start = 0xA0000 / PAGE_SIZE;
-  uint32_t vga_frames = 0x20000 / PAGE_SIZE; // 128KB
-  bitmap_mark_range_used(&vm_bitmap, vga_start, vga_frames);
-  if (PRINT_MEMORY_MAP)
-    printf("  - Reserved: VGA memory (0xA0000-0xBFFFF)\n");
-
-  // 5. Reserve ROM area (0xC0000-0xFFFFF)
-  uint32_t rom_start = 0xC0000 / PAGE_SIZE;
-  uint32_t rom_frames = 0x40000 / PAGE_SIZE; // 256KB
-  bitmap_mark_range_used(&vm_bitmap, rom_start, rom_frames);
-  if (PRINT_MEMORY_MAP)
-    printf("  - Reserved: BIOS ROM area (0xC0000-0xFFFFF)\n");
+// Step 2b: Place the per-frame metadata of the buddy allocator the same way
+static bool pfa_init_buddy_storage(uint32_t num_frames) {
+  uint32_t free_words = BUDDY_FREE_WORDS(num_frames);
+  uint32_t summary_words = BUDDY_SUMMARY_WORDS(num_frames);
+  uint32_t bytes = (free_words + summary_words) * sizeof(uint32_t);
+  phys_addr_t phys = memblock_alloc(bytes, PAGE_SIZE);
+  if (phys == 0)
+    return false;
+
+  uint32_t *storage = (uint32_t *)phys_to_virt(phys);
+  buddy_set_storage(storage, free_words, storage + free_words, summary_words);
+  printf("PFA: Buddy bitmaps take %u KB at 0x%x\n", CEIL_DIV(bytes, 1024),
+         (uint32_t)phys);
+  return true;
 }
 
-// Step 4: Mark kernel memory as used
-static void pfa_reserve_kernel_memory(void) {
-  // Calculate kernel's physical memory range
-  uintptr_t kernel_start = (uintptr_t)&kernel_physical_start;
-  uintptr_t kernel_end = (uintptr_t)&kernel_physical_end;
-
-  // Also reserve some space after kernel for dynamic allocations
-  uintptr_t reserved_end = kernel_end + (1024 * 1024); // +1MB after kernel
+// Step 3: Mark the RAM memblock knows about as free. Partial frames were
+// already trimmed off
+static void pfa_mark_usable_memory(void) {
+  for (uint32_t i = 0; i < memblock_memory.count; i++) {
+    memblock_region_t *region = &memblock_memory.regions[i];
+    uint32_t start_frame = (uint32_t)(region->base / PAGE_SIZE);
+    uint32_t num_frames = (uint32_t)((region->end - region->base) / PAGE_SIZE);
 
-  uint32_t start_frame = kernel_start / PAGE_SIZE;
-  uint32_t end_frame = (reserved_end + PAGE_SIZE - 1) / PAGE_SIZE;
-  uint32_t num_frames = end_frame - start_frame;
+    bitmap_mark_range_free(&vm_bitmap, start_frame, num_frames);
+    zone_account_region(start_frame, num_frames);
 
-  bitmap_mark_range_used(&vm_bitmap, start_frame, num_frames);
+    if (PRINT_MEMORY_MAP)
+      printf("  - Marked free: frames %u-%u (%u KB)\n", start_frame,
+             start_frame + num_frames - 1, num_frames * 4);
+  }
 
-  printf("PFA: Reserved kernel memory:\n");
-  printf("  - Physical: 0x%x-0x%x\n", kernel_start, reserved_end);
-  printf("  - Frames: %u-%u (%u frames, %u KB)\n", start_frame, end_frame - 1,
-         num_frames, (num_frames * 4));
+  printf("PFA: Marked %u usable regions as free\n", memblock_memory.count);
 }
 
-// Step 5: Reserve multiboot structures
-static void pfa_reserve_multiboot_structures(multiboot_info_t *mbi) {
-  printf("PFA: Reserving multiboot structures...\n");
-
-  // 1. Reserve the multiboot info structure itself
-  uint32_t mbi_frame = ((uintptr_t)mbi) / PAGE_SIZE;
-  bitmap_set(vm_bitmap.bitmap, mbi_frame);
-
-  // 2. Reserve memory map area
-  if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
-    uint32_t mmap_start_frame = mbi->mmap_addr / PAGE_SIZE;
-    uint32_t mmap_pages = (mbi->mmap_length + PAGE_SIZE - 1) / PAGE_SIZE;
-    bitmap_mark_range_used(&vm_bitmap, mmap_start_frame, mmap_pages);
-  }
-
-  // 3. Reserve modules if any
-  if (mbi->flags & MULTIBOOT_INFO_MODS && mbi->mods_count > 0) {
-    multiboot_module_t *mod = (multiboot_module_t *)mbi->mods_addr;
-    for (uint32_t i = 0; i < mbi->mods_count; i++) {
-      uint32_t mod_start_frame = mod[i].mod_start / PAGE_SIZE;
-      uint32_t mod_end_frame = (mod[i].mod_end + PAGE_SIZE - 1) / PAGE_SIZE;
-      bitmap_mark_range_used(&vm_bitmap, mod_start_frame,
-                             mod_end_frame - mod_start_frame);
-      printf("  - Reserved module %u: frames %u-%u\n", i, mod_start_frame,
-             mod_end_frame - 1);
-    }
+// Step 4: Mark every memblock reservation as used: firmware areas, the kernel
+// image, multiboot data and the metadata placed in step 2
+static void pfa_reserve_memblock(void) {
+  for (uint32_t i = 0; i < memblock_reserved.count; i++) {
+    memblock_region_t *region = &memblock_reserved.regions[i];
+    if (region->base >= (uint64_t)vm_bitmap.total_frames * PAGE_SIZE)
+      break;
+
+    uint32_t start_frame = (uint32_t)(region->base / PAGE_SIZE);
+    uint32_t end_frame = (uint32_t)(region->end / PAGE_SIZE);
+    if (end_frame > vm_bitmap.total_frames)
+      end_frame = vm_bitmap.total_frames;
+    bitmap_mark_range_used(&vm_bitmap, start_frame, end_frame - start_frame);
   }
+}
 
-  // 4. Reserve command line if present
-  if (mbi->flags & MULTIBOOT_INFO_CMDLINE) {
-    uint32_t cmdline_frame = mbi->cmdline / PAGE_SIZE;
-    bitmap_set(vm_bitmap.bitmap, cmdline_frame);
-  }
+// Step 5: Split memory into zones and hand every remaining free frame to the
+// zone's buddy allocator
+static void pfa_seed_buddy(void) {
+  zones_init(vm_bitmap.total_frames);
+  zone_print_stats();
 }
 
 // Step 6: Count available frames for statistics
 static uint32_t pfa_count_free_frames(void) {
-  uint32_t free_count = 0;
-
-  for (uint32_t i = 0; i < vm_bitmap.total_frames; i++) {
-    uint32_t byte_idx = i / 8;
-    uint32_t bit_idx = i % 8;
-
-    if ((vm_bitmap.bitmap[byte_idx] & (1 << bit_idx)) == 0) {
-      free_count++;
-    }
-  }
-
-  return free_count;
+  return bitmap_count_clear(vm_bitmap.bitmap, 0, vm_bitmap.total_frames);
 }
 
 // ============= Main Initialization Function =============
@@ -191,22 +111,29 @@ void init_pfa(multiboot_info_t *mbi) {
     return;
   }
 
-  // Step 2: Initialize bitmap (all marked as used initially)
-  pfa_init_bitmap(vm_bitmap.total_frames);
+  // Step 2: Let memblock place the bitmap and the buddy bitmaps, sized for
+  // the RAM that is actually there, around what is already in use
+  memblock_init(mbi);
+  if (!pfa_init_bitmap(vm_bitmap.total_frames) ||
+      !pfa_init_buddy_storage(vm_bitmap.total_frames)) {
+    printf("PFA: No room for the frame metadata!\n");
+    return;
+  }
 
   // Step 3: Mark usable memory regions as free
-  pfa_mark_usable_memory(mbi);
-
-  // Step 4: Reserve critical system areas
-  pfa_reserve_system_areas();
+  pfa_mark_usable_memory();
 
-  // Step 5: Reserve kernel memory
-  pfa_reserve_kernel_memory();
+  // Step 4: Carve out everything memblock has reserved
+  pfa_reserve_memblock();
+  memblock_print_stats();
 
-  // Step 6: Reserve multiboot structures
-  pfa_reserve_multiboot_structures(mbi);
+  // Step 5: Seed the buddy free lists from the usable regions of the memory
+  // map, now that every reservation has been carved out of them. memblock is
+  // done, the rest of physical memory belongs to the PFA
+  pfa_seed_buddy();
+  memblock_retire();
 
-  // Step 7: Calculate and display statistics
+  // Step 6: Calculate and display statistics
   vm_bitmap.free_frames = pfa_count_free_frames();
   uint32_t used_frames = vm_bitmap.total_frames - vm_bitmap.free_frames;
 
@@ -225,79 +152,425 @@ void init_pfa(multiboot_info_t *mbi) {
   printf("PFA: Ready for allocations\n\n");
 }
 
-uintptr_t pfa_alloc() {
-  for (uint32_t byte = 0; byte < vm_bitmap.bitmap_size; byte++) {
-    if (vm_bitmap.bitmap[byte] !=
-        0xFF) { // There is at least one free bit in this byte
-      for (uint8_t bit = 0; bit < BITS_PER_BYTE; bit++) {
-        uint8_t test_bit = 1 << bit;
-        // Check if this bit is free (== 0)
-        if ((vm_bitmap.bitmap[byte] & test_bit) == 0) {
-          // Mark as used
-          vm_bitmap.bitmap[byte] |= test_bit;
-          uint32_t frame_num = (byte * BITS_PER_BYTE) + bit;
-          uintptr_t phys_addr = frame_num * PAGE_SIZE;
-          // Make sure we don't go past the max allowed physical address
-          if (phys_addr >= vm_bitmap.max_phys_addr)
-            return 0; // Out of physical memory
-
-          // can't return frame 0, 0 is considered error code here
-          if (phys_addr)
-            return phys_addr;
-        }
+// Allocate 2^order physically contiguous frames, aligned to their size, from
+// the preferred zone or, failing that, from the zones below it (High falls
+// back to Normal, Normal to DMA). The preferred zone may be drained down to
+// its min watermark, a fallback zone only down to its low watermark, so
+// scarce low memory stays available to the callers that need it.
+// Returns the physical address of the first frame, 0 when out of memory.
+phys_addr_t pfa_alloc_zone(zone_type_t preferred, uint32_t order) {
+  if (order > BUDDY_MAX_ORDER || preferred >= NUM_ZONES)
+    return 0;
+
+  uint32_t flags = irq_save();
+  for (int32_t z = preferred; z >= 0; z--) {
+    zone_t *zone = &zones[z];
+    uint32_t mark = ((zone_type_t)z == preferred) ? zone->watermark_min
+                                                  : zone->watermark_low;
+    int32_t frame = zone_alloc(zone, order, mark);
+    if (frame < 0)
+      continue;
+
+    bitmap_mark_range_used(&vm_bitmap, frame, BUDDY_BLOCK_FRAMES(order));
+    vm_bitmap.free_frames -= BUDDY_BLOCK_FRAMES(order);
+    irq_restore(flags);
+
+    // Frame 0 is always reserved, so 0 stays the error code
+    return (phys_addr_t)frame * PAGE_SIZE;
+  }
+
+  irq_restore(flags);
+  return 0; // Out of frames
+}
+
+phys_addr_t pfa_alloc_order(uint32_t order) {
+  return pfa_alloc_zone(ZONE_NORMAL, order);
+}
+
+// Allocate up to n frames in one go, not necessarily contiguous. Frames are
+// taken as the largest buddy blocks that still fit the remaining count, so a
+// big request turns into a handful of block allocations instead of n separate
+// searches, and neighbouring pages mostly get neighbouring frames.
+// Zone fallback works as in pfa_alloc_zone. Returns how many frames were
+// written to out; each can be released with pfa_free.
+uint32_t pfa_alloc_bulk_zone(zone_type_t preferred, uint32_t n,
+                             phys_addr_t out[]) {
+  if (preferred >= NUM_ZONES)
+    return 0;
+
+  uint32_t flags = irq_save();
+  uint32_t got = 0;
+  for (int32_t z = preferred; z >= 0 && got < n; z--) {
+    zone_t *zone = &zones[z];
+    uint32_t mark = ((zone_type_t)z == preferred) ? zone->watermark_min
+                                                  : zone->watermark_low;
+
+    while (got < n) {
+      // Largest order that doesn't overshoot what's left
+      uint32_t order = 31 - __builtin_clz(n - got);
+      if (order > BUDDY_MAX_ORDER)
+        order = BUDDY_MAX_ORDER;
+
+      int32_t frame = zone_alloc(zone, order, mark);
+      while (frame < 0 && order > 0) {
+        order--;
+        frame = zone_alloc(zone, order, mark);
+      }
+      if (frame < 0)
+        break; // Zone exhausted, move on to the next one
+
+      bitmap_mark_range_used(&vm_bitmap, frame, BUDDY_BLOCK_FRAMES(order));
+      vm_bitmap.free_frames -= BUDDY_BLOCK_FRAMES(order);
+
+      for (uint32_t i = 0; i < BUDDY_BLOCK_FRAMES(order); i++) {
+        out[got++] = (phys_addr_t)(frame + i) * PAGE_SIZE;
       }
     }
   }
-  return 0; // Out of frames
+
+  irq_restore(flags);
+  return got;
+}
+
+uint32_t pfa_alloc_bulk(uint32_t n, phys_addr_t out[]) {
+  return pfa_alloc_bulk_zone(ZONE_NORMAL, n, out);
+}
+
+// True if the frame lies in the part of its zone the buddy allocator manages
+static inline bool pfa_frame_managed(uint32_t frame) {
+  if (frame >= vm_bitmap.total_frames)
+    return false;
+  buddy_area_t *area = &zone_of_frame(frame)->area;
+  return frame >= area->start_frame &&
+         frame - area->start_frame < area->num_frames;
+}
+
+// Return a block obtained from pfa_alloc_zone/pfa_alloc_order with the same
+// order, it goes back to the zone it came from. Returns false if the block
+// was rejected and nothing changed
+bool pfa_free_order(phys_addr_t phys_addr, uint32_t order) {
+  if (phys_addr == 0 || phys_addr >= vm_bitmap.max_phys_addr ||
+      order > BUDDY_MAX_ORDER)
+    return false;
+
+  uint32_t frame_num = (uint32_t)(phys_addr / PAGE_SIZE);
+  if (frame_num & (BUDDY_BLOCK_FRAMES(order) - 1)) {
+    printf("PFA: Misaligned free of frame %u (order %u)\n", frame_num, order);
+    return false;
+  }
+  // Every frame of the block has to be in use. Testing only the first lets a
+  // free with the wrong order, or of a partly freed block, through, and the
+  // buddy bitmaps would then hold the same frames twice
+  uint32_t end_frame = frame_num + BUDDY_BLOCK_FRAMES(order);
+  uint32_t flags = irq_save();
+  if (!pfa_frame_managed(frame_num) ||
+      bitmap_find_next_clear(vm_bitmap.bitmap, frame_num, end_frame) !=
+          end_frame) {
+    irq_restore(flags);
+    printf("PFA: Free of frames %u-%u (order %u), not all allocated\n",
+           frame_num, end_frame - 1, order);
+    return false;
+  }
+
+  bitmap_mark_range_free(&vm_bitmap, frame_num, BUDDY_BLOCK_FRAMES(order));
+  vm_bitmap.free_frames += BUDDY_BLOCK_FRAMES(order);
+
+  zone_free(zone_of_frame(frame_num), frame_num, order);
+  irq_restore(flags);
+  return true;
+}
+
+// ============= Per-CPU Frame Magazines =============
+// Single frames are served from a per-CPU cache in front of the buddy
+// allocator (Bonwick-style magazines). Each CPU holds a loaded and a previous
+// magazine per zone; alloc pops from loaded, free pushes to it, and the two
+// are swapped before going to the global pool. Only a completely empty or full
+// pair costs a refill or drain, which moves a whole magazine of frames at once.
+// Freed frames always go to the magazines of their own zone.
+//
+// A frame sitting in a magazine is clear in the bitmap, like a free one, and
+// only marked used again when it is handed out. So freeing it a second time
+// fails the bitmap check instead of putting it in a magazine twice. It still
+// counts as taken in free_frames, which tracks the buddy allocator.
+#define PFA_MAG_SIZE 32 // Frames per magazine, also the refill/drain batch
+
+typedef struct {
+  phys_addr_t rounds[PFA_MAG_SIZE];
+  uint32_t count;
+} pfa_magazine_t;
+
+typedef struct {
+  pfa_magazine_t *loaded;
+  pfa_magazine_t *previous;
+  pfa_magazine_t mags[2];
+} pfa_mag_pair_t;
+
+typedef struct {
+  pfa_mag_pair_t zones[NUM_ZONES];
+
+  // Statistics
+  uint32_t alloc_hits; // Served without touching the global pool
+  uint32_t free_hits;
+  uint32_t refills; // Batches pulled from the global pool
+  uint32_t drains;  // Batches pushed back to the global pool
+} __cacheline_aligned pfa_cpu_cache_t;
+
+static pfa_cpu_cache_t pfa_cpu_cache[MAX_CPUS];
+
+// Caller must have interrupts disabled
+static pfa_mag_pair_t *pfa_this_cpu_mags(zone_type_t zone) {
+  pfa_mag_pair_t *pair = &pfa_cpu_cache[cpu_id()].zones[zone];
+  if (pair->loaded == NULL) {
+    pair->loaded = &pair->mags[0];
+    pair->previous = &pair->mags[1];
+  }
+  return pair;
+}
+
+static void pfa_mags_swap(pfa_mag_pair_t *pair) {
+  pfa_magazine_t *tmp = pair->loaded;
+  pair->loaded = pair->previous;
+  pair->previous = tmp;
+}
+
+// Fill an empty magazine from the zone itself. No fallback here: a refill
+// must not hoard a whole batch of some lower zone's frames.
+static void pfa_cache_refill(pfa_magazine_t *mag, zone_type_t type) {
+  zone_t *zone = &zones[type];
+  while (mag->count < PFA_MAG_SIZE) {
+    int32_t frame = zone_alloc(zone, 0, zone->watermark_min);
+    if (frame < 0)
+      break; // Zone is at its watermark, hand out what we got
+
+    vm_bitmap.free_frames--;
+    mag->rounds[mag->count++] = (phys_addr_t)frame * PAGE_SIZE;
+  }
+}
+
+// Return every frame of a full magazine to the global pool. Caller must have
+// interrupts disabled. The frames are already clear in the bitmap, and were
+// checked when they were freed into the magazine
+static void pfa_cache_drain(pfa_magazine_t *mag) {
+  while (mag->count > 0) {
+    uint32_t frame = (uint32_t)(mag->rounds[--mag->count] / PAGE_SIZE);
+    vm_bitmap.free_frames++;
+    zone_free(zone_of_frame(frame), frame, 0);
+  }
 }
 
-void pfa_free(uintptr_t phys_addr) {
+// Allocate a single frame, preferring the given zone
+phys_addr_t pfa_alloc_frame(zone_type_t zone) {
+  if (zone >= NUM_ZONES)
+    return 0;
+
+  uint32_t flags = irq_save();
+  pfa_cpu_cache_t *cache = &pfa_cpu_cache[cpu_id()];
+  pfa_mag_pair_t *pair = pfa_this_cpu_mags(zone);
+
+  if (pair->loaded->count > 0) {
+    cache->alloc_hits++;
+  } else if (pair->previous->count > 0) {
+    pfa_mags_swap(pair);
+    cache->alloc_hits++;
+  } else {
+    pfa_cache_refill(pair->loaded, zone);
+    cache->refills++;
+  }
+
+  phys_addr_t phys = 0;
+  if (pair->loaded->count > 0) {
+    phys = pair->loaded->rounds[--pair->loaded->count];
+    bitmap_set(vm_bitmap.bitmap, (uint32_t)(phys / PAGE_SIZE));
+  }
+
+  irq_restore(flags);
+
+  if (phys == 0) {
+    phys = pfa_alloc_zone(zone, 0); // Zone is dry, try the fallback zones
+  }
+  return phys;
+}
+
+phys_addr_t pfa_alloc() { return pfa_alloc_frame(ZONE_NORMAL); }
+
+void pfa_free(phys_addr_t phys_addr) {
   if (phys_addr == 0 || phys_addr >= vm_bitmap.max_phys_addr)
     return;
-  uint32_t frame_num = phys_addr / PAGE_SIZE;
-  if (bitmap_test(vm_bitmap.bitmap, frame_num)) {
-    bitmap_clear(vm_bitmap.bitmap, frame_num);
+
+  // A frame that is free in the bitmap (or already in a magazine), or that
+  // the buddy allocator never managed, must not reach a magazine: it would be
+  // handed out twice. Test and clear together, with interrupts off
+  uint32_t frame_num = (uint32_t)(phys_addr / PAGE_SIZE);
+  uint32_t flags = irq_save();
+  if (!pfa_frame_managed(frame_num) ||
+      !bitmap_test(vm_bitmap.bitmap, frame_num)) {
+    irq_restore(flags);
+    printf("PFA: Free of frame %u, which is not allocated\n", frame_num);
+    return;
   }
+  bitmap_clear(vm_bitmap.bitmap, frame_num);
+
+  pfa_cpu_cache_t *cache = &pfa_cpu_cache[cpu_id()];
+  pfa_mag_pair_t *pair = pfa_this_cpu_mags(zone_type_of_frame(frame_num));
+
+  if (pair->loaded->count < PFA_MAG_SIZE) {
+    cache->free_hits++;
+  } else if (pair->previous->count < PFA_MAG_SIZE) {
+    pfa_mags_swap(pair);
+    cache->free_hits++;
+  } else {
+    // Both full: drain the older one and keep the hot one loaded
+    pfa_cache_drain(pair->previous);
+    pfa_mags_swap(pair);
+    cache->drains++;
+  }
+
+  pair->loaded->rounds[pair->loaded->count++] =
+      phys_addr & ~(phys_addr_t)(PAGE_SIZE - 1);
+
+  irq_restore(flags);
 }
 
-static void temp_map(uintptr_t phys_addr) {
-  page_table[1023] = (uint32_t)phys_addr | 3; // Present + writable
-  asm volatile("invlpg %0"
-               :
-               : "m"(*(char *)TEMP_MAP_ADDR)); // Flush TLB for this addr
+void pfa_print_cache_stats(void) {
+  printf("PFA: Per-CPU frame cache:\n");
+  for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    pfa_cpu_cache_t *cache = &pfa_cpu_cache[cpu];
+    uint32_t allocs = cache->alloc_hits + cache->refills;
+    uint32_t frees = cache->free_hits + cache->drains;
+    uint32_t cached = 0;
+    for (uint32_t z = 0; z < NUM_ZONES; z++) {
+      cached += cache->zones[z].mags[0].count + cache->zones[z].mags[1].count;
+    }
+
+    printf("  - CPU %u: %u cached, alloc hits %u/%u (%u%%), free hits %u/%u, "
+           "%u refills, %u drains\n",
+           cpu, cached, cache->alloc_hits, allocs,
+           allocs ? (cache->alloc_hits * 100) / allocs : 0, cache->free_hits,
+           frees, cache->refills, cache->drains);
+  }
 }
 
-static void temp_unmap() {
-  page_table[1023] = 0; // Unmap
-  asm volatile("invlpg %0" : : "m"(*(char *)TEMP_MAP_ADDR));
+// ============= Pre-Zeroed Frame Pool =============
+// Frames zeroed ahead of time from the idle loop, so page tables and
+// demand-zero pages don't have to clear a frame while the caller waits. Idle
+// refill starts once the pool drops below the low watermark and runs until it
+// reaches the high one.
+#define PFA_ZERO_POOL_SIZE 64
+#define PFA_ZERO_POOL_LOW 16
+#define PFA_ZERO_POOL_HIGH 48
+
+static phys_addr_t pfa_zero_pool[PFA_ZERO_POOL_SIZE];
+static uint32_t pfa_zero_pool_count = 0;
+static bool pfa_zero_pool_filling = true; // Start filling on the first idle
+
+// Statistics
+static uint32_t pfa_zero_pool_hits = 0;
+static uint32_t pfa_zero_pool_misses = 0;
+
+// Zero a frame. Low memory is cleared in place through the direct map, high
+// frames through a kmap_atomic slot. Returns false if no slot was free, the
+// frame is left as it was
+static bool pfa_zero_frame(phys_addr_t phys_addr) {
+  void *page = kmap_atomic(phys_addr);
+  if (page == NULL)
+    return false;
+  memset32(page, 0, PAGE_SIZE / sizeof(uint32_t));
+  kunmap_atomic(page);
+  return true;
 }
 
-// new page table for the virtual range starting at (pde_index * 4MB)
+// Allocate a frame that is guaranteed to be zero-filled
+phys_addr_t pfa_alloc_zeroed(void) {
+  uint32_t flags = irq_save();
+  if (pfa_zero_pool_count > 0) {
+    phys_addr_t phys = pfa_zero_pool[--pfa_zero_pool_count];
+    if (pfa_zero_pool_count < PFA_ZERO_POOL_LOW) {
+      pfa_zero_pool_filling = true;
+    }
+    pfa_zero_pool_hits++;
+    irq_restore(flags);
+    return phys;
+  }
+  pfa_zero_pool_filling = true;
+  pfa_zero_pool_misses++;
+  irq_restore(flags);
+
+  // Pool is dry, fall back to clearing synchronously
+  phys_addr_t phys = pfa_alloc();
+  if (phys != 0 && !pfa_zero_frame(phys)) {
+    pfa_free(phys);
+    return 0;
+  }
+  return phys;
+}
+
+// Zero one more frame into the pool if it is below its target. Meant for the
+// idle loop: returns true if it did some work, false when there is nothing
+// to do and the CPU can halt.
+bool pfa_zero_pool_refill(void) {
+  if (!pfa_zero_pool_filling)
+    return false;
+
+  // Stop at the high watermark, or earlier if memory is getting tight
+  zone_t *zone = &zones[ZONE_NORMAL];
+  if (pfa_zero_pool_count >= PFA_ZERO_POOL_HIGH ||
+      (zone->managed_frames > 0 &&
+       !zone_watermark_ok(zone, 0, zone->watermark_high))) {
+    pfa_zero_pool_filling = false;
+    return false;
+  }
+
+  phys_addr_t phys = pfa_alloc();
+  if (phys == 0) {
+    pfa_zero_pool_filling = false; // Out of memory, don't spin on it
+    return false;
+  }
+
+  if (!pfa_zero_frame(phys)) {
+    pfa_free(phys); // Try again on a later idle pass
+    return false;
+  }
+
+  uint32_t flags = irq_save();
+  if (pfa_zero_pool_count < PFA_ZERO_POOL_SIZE) {
+    pfa_zero_pool[pfa_zero_pool_count++] = phys;
+    phys = 0;
+  }
+  irq_restore(flags);
+
+  if (phys != 0) {
+    pfa_free(phys); // Raced with a refill from an interrupt, pool is full
+  }
+  return true;
+}
+
+void pfa_print_zero_pool_stats(void) {
+  printf("PFA: Zero pool: %u/%u frames, %u hits, %u misses\n",
+         pfa_zero_pool_count, PFA_ZERO_POOL_SIZE, pfa_zero_pool_hits,
+         pfa_zero_pool_misses);
+}
+
+// new page table for the virtual range starting at (pde_index << PDE_SHIFT)
 // function allocates a new page table (PT) in physical memory, initializes it,
 // and links it into the current page directory (the global page_directory
 // array) at a specific index
-void alloc_new_pt(uint32_t *page_directory, uint32_t pde_index) {
-  uintptr_t pt_phys = pfa_alloc();
+void alloc_new_pt(pte_t *page_directory, uint32_t pde_index) {
+  // Comes zeroed, so all PTEs start invalid (not mapping anything)
+  phys_addr_t pt_phys = pfa_alloc_zeroed();
   if (pt_phys == 0) {
     printf("OOM: Can't alloc new PT\n");
     return;
   }
 
-  temp_map(pt_phys); // Map temporarily
-  uint32_t *new_pt = (uint32_t *)TEMP_MAP_ADDR;
-  // Zero the new PT, ensures all PTEs start invalid (not mapping anything)
-  memset(new_pt, 0, PAGE_SIZE);
-
   // Writes the physical address of the new PT into the specified PDE index in
   // the current page directory
-  page_directory[pde_index] = (uint32_t)pt_phys | 3;
+  set_pte(&page_directory[pde_index], pt_phys | 3);
   // sets the present (bit 0) and read/write (bit 1) flags
   // You might add User flag (bit 2) for user-mode access
 
-  // full TLB flush, temporary due to inefficiency
-  asm volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax");
+  // No TLB flush: the PDE wasn't present, and neither was the recursive
+  // mapping of the new PT at GET_PT(pde_index), so nothing stale is cached
 
-  temp_unmap(); // Clean up
-  printf("PFA: New PT allocated at phys %p, mapped to PDE %u\n", pt_phys,
-         pde_index);
+  printf("PFA: New PT allocated at frame %u, mapped to PDE %u\n",
+         (uint32_t)(pt_phys / PAGE_SIZE), pde_index);
 }
@@ -1,11 +1,10 @@
 #pragma once
 #include "multiboot_gnu.h"
 #include "util/bitmap.h"
+#include <memory/paging.h>
 #include <stdint.h>
 #include <util/printf.h>
 
-#define PAGE_SIZE 4096
-
 extern vm_bitmap_t vm_bitmap;
 
 // Get human-readable memory type string
@@ -49,9 +48,9 @@ static void print_memory_region(multiboot_memory_map_t *entry) {
 
 // Process memory map to find usable boundaries
 static void find_usable_memory_bounds(multiboot_info_t *mbi,
-                                      uint32_t *out_max_usable_addr,
+                                      uint64_t *out_max_usable_addr,
                                       uint32_t *out_total_usable_kb) {
-  uint32_t max_usable_addr = 0;
+  uint64_t max_usable_addr = 0;
   uint32_t total_usable_kb = 0;
 
   multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)mbi->mmap_addr;
@@ -63,15 +62,15 @@ static void find_usable_memory_bounds(multiboot_info_t *mbi,
       uint64_t length = mmap->len;
       uint64_t end = base + length;
 
-      // For 32-bit kernel, cap at 4GB
-      if (end > 0xFFFFFFFF) {
-        end = 0xFFFFFFFF;
-        length = end - base;
+      // Cap at what the PFA can track: 4GB, or more with PAE
+      if (end > PFA_MAX_PHYS_ADDR) {
+        end = PFA_MAX_PHYS_ADDR;
+        length = base < end ? end - base : 0;
       }
 
-      // Track the highest usable address (within 32-bit range)
-      if (end > max_usable_addr && base < 0xFFFFFFFF) {
-        max_usable_addr = (uint32_t)end;
+      // Track the highest usable address (within the trackable range)
+      if (end > max_usable_addr && base < PFA_MAX_PHYS_ADDR) {
+        max_usable_addr = end;
       }
 
       // Accumulate total usable memory
@@ -112,18 +111,18 @@ uint32_t get_max_usable_pages(multiboot_info_t *mbi) {
   }
 
   // Second pass: Calculate usable memory statistics
-  uint32_t max_usable_addr = 0;
+  uint64_t max_usable_addr = 0;
   uint32_t total_usable_kb = 0;
   find_usable_memory_bounds(mbi, &max_usable_addr, &total_usable_kb);
 
   // Store global values
   vm_bitmap.max_phys_addr = max_usable_addr;
-  vm_bitmap.total_frames = vm_bitmap.max_phys_addr / PAGE_SIZE;
+  vm_bitmap.total_frames = (uint32_t)(vm_bitmap.max_phys_addr / PAGE_SIZE);
 
   // Print summary
   if (PRINT_MEMORY_MAP) {
     printf("=== Memory Summary ===\n");
-    printf("Highest usable address: 0x%x\n", vm_bitmap.max_phys_addr);
+    printf("Highest usable frame: %u\n", vm_bitmap.total_frames - 1);
     printf("Total usable memory: %u KB (%u MB)\n", total_usable_kb,
            total_usable_kb / 1024);
     printf("Total page frames: %u\n", vm_bitmap.total_frames);
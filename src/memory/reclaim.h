@@ -0,0 +1,231 @@
+#pragma once
+#include <memory/memory.h>
+#include <memory/multiboot_gnu.h>
+#include <memory/pfa.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <util/printf.h>
+
+// Boot-time memory that init_pfa keeps reserved only because somebody still
+// needs it during boot. Once those consumers are done, pfa_reclaim_boot_memory
+// hands it back to the allocator, one stage per kind of memory.
+#define RECLAIM_ACPI (1 << 0)         // ACPI reclaimable regions
+#define RECLAIM_MODULES (1 << 1)      // Multiboot module images
+#define RECLAIM_BOOT_INFO (1 << 2)    // Multiboot info, memory map, cmdline
+#define RECLAIM_IDENTITY_MAP (1 << 3) // Boot identity mapping
+#define RECLAIM_ALL                                                            \
+  (RECLAIM_ACPI | RECLAIM_MODULES | RECLAIM_BOOT_INFO | RECLAIM_IDENTITY_MAP)
+
+static inline bool frame_in_range(uint32_t frame, uintptr_t start,
+                                  uintptr_t end) {
+  return frame >= start / PAGE_SIZE &&
+         frame < (end + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+// Frames that are backed by RAM the allocator may own: usable regions, plus
+// ACPI reclaimable ones when that stage runs
+static bool reclaim_frame_in_ram(multiboot_info_t *mbi, uint32_t frame,
+                                 uint32_t stages) {
+  multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)mbi->mmap_addr;
+  uintptr_t mmap_end = mbi->mmap_addr + mbi->mmap_length;
+
+  while ((uintptr_t)mmap < mmap_end) {
+    bool usable = mmap->type == MULTIBOOT_MEMORY_AVAILABLE ||
+                  ((stages & RECLAIM_ACPI) &&
+                   mmap->type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE);
+    uint64_t frame_addr = (uint64_t)frame * PAGE_SIZE;
+    if (usable && frame_addr >= mmap->addr &&
+        frame_addr + PAGE_SIZE <= mmap->addr + mmap->len) {
+      return true;
+    }
+
+    mmap = (multiboot_memory_map_t *)((uintptr_t)mmap + mmap->size +
+                                      sizeof(mmap->size));
+  }
+
+  return false;
+}
+
+// True if the frame still holds something that outlives the stages being
+// reclaimed (mirrors the reservations made by init_pfa)
+static bool reclaim_frame_is_live(multiboot_info_t *mbi, uint32_t frame,
+                                  uint32_t stages) {
+  // NULL guard page, EBDA, VGA memory and BIOS ROM
+  if (frame == 0 || frame_in_range(frame, 0x9F000, 0x100000))
+    return true;
+
+  // The kernel image itself
+  uintptr_t kernel_end = (uintptr_t)&kernel_virtual_end - KERNEL_VIRTUAL_BASE;
+  if (frame_in_range(frame, (uintptr_t)&kernel_physical_start, kernel_end))
+    return true;
+
+  if (!(stages & RECLAIM_BOOT_INFO)) {
+    uintptr_t mbi_phys = (uintptr_t)mbi - KERNEL_VIRTUAL_BASE;
+    if (frame_in_range(frame, mbi_phys, mbi_phys + sizeof(*mbi)))
+      return true;
+    if ((mbi->flags & MULTIBOOT_INFO_MEM_MAP) &&
+        frame_in_range(frame, mbi->mmap_addr,
+                       mbi->mmap_addr + mbi->mmap_length))
+      return true;
+    if ((mbi->flags & MULTIBOOT_INFO_CMDLINE) &&
+        frame == mbi->cmdline / PAGE_SIZE)
+      return true;
+  }
+
+  if (!(stages & RECLAIM_MODULES) && (mbi->flags & MULTIBOOT_INFO_MODS) &&
+      mbi->mods_count > 0) {
+    multiboot_module_t *mod = (multiboot_module_t *)mbi->mods_addr;
+    if (frame_in_range(frame, mbi->mods_addr,
+                       mbi->mods_addr + mbi->mods_count * sizeof(*mod)))
+      return true; // The module list itself
+    for (uint32_t i = 0; i < mbi->mods_count; i++) {
+      if (frame_in_range(frame, mod[i].mod_start, mod[i].mod_end))
+        return true;
+    }
+  }
+
+  return false;
+}
+
+// Return every reserved, no longer live frame of [start, end) to the PFA.
+// Frames that were never seeded also grow their zone. Returns the count.
+static uint32_t reclaim_range(multiboot_info_t *mbi, phys_addr_t start,
+                              phys_addr_t end, uint32_t stages) {
+  uint32_t first = (uint32_t)(start / PAGE_SIZE);
+  uint32_t last = (uint32_t)((end + PAGE_SIZE - 1) / PAGE_SIZE);
+  if (last > vm_bitmap.total_frames) {
+    last = vm_bitmap.total_frames;
+  }
+
+  uint32_t reclaimed = 0;
+  for (uint32_t frame = first; frame < last; frame++) {
+    if (!bitmap_test(vm_bitmap.bitmap, frame))
+      continue; // Already free
+    if (reclaim_frame_is_live(mbi, frame, stages) ||
+        !reclaim_frame_in_ram(mbi, frame, stages))
+      continue;
+
+    if (!pfa_free_order((phys_addr_t)frame * PAGE_SIZE, 0))
+      continue; // Outside what the buddy allocator manages
+    zone_of_frame(frame)->managed_frames++;
+    reclaimed++;
+  }
+
+  return reclaimed;
+}
+
+static uint32_t reclaim_acpi(multiboot_info_t *mbi, uint32_t stages) {
+  multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)mbi->mmap_addr;
+  uintptr_t mmap_end = mbi->mmap_addr + mbi->mmap_length;
+  uint32_t reclaimed = 0;
+
+  while ((uintptr_t)mmap < mmap_end) {
+    if (mmap->type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE &&
+        mmap->addr < vm_bitmap.max_phys_addr) {
+      uint64_t end = mmap->addr + mmap->len;
+      if (end > vm_bitmap.max_phys_addr) {
+        end = vm_bitmap.max_phys_addr;
+      }
+      reclaimed += reclaim_range(mbi, (phys_addr_t)mmap->addr,
+                                 (phys_addr_t)end, stages);
+    }
+
+    mmap = (multiboot_memory_map_t *)((uintptr_t)mmap + mmap->size +
+                                      sizeof(mmap->size));
+  }
+
+  return reclaimed;
+}
+
+static uint32_t reclaim_modules(multiboot_info_t *mbi, uint32_t stages) {
+  if (!(mbi->flags & MULTIBOOT_INFO_MODS) || mbi->mods_count == 0)
+    return 0;
+
+  multiboot_module_t *mod = (multiboot_module_t *)mbi->mods_addr;
+  uint32_t reclaimed = 0;
+  for (uint32_t i = 0; i < mbi->mods_count; i++) {
+    reclaimed += reclaim_range(mbi, mod[i].mod_start, mod[i].mod_end, stages);
+  }
+  // Then the list describing them, which stays readable until reallocated
+  reclaimed += reclaim_range(mbi, mbi->mods_addr,
+                             mbi->mods_addr + mbi->mods_count * sizeof(*mod),
+                             stages);
+  return reclaimed;
+}
+
+static uint32_t reclaim_boot_info(multiboot_info_t *mbi, uint32_t stages) {
+  uintptr_t mbi_phys = (uintptr_t)mbi - KERNEL_VIRTUAL_BASE;
+  uint32_t reclaimed = 0;
+
+  if (mbi->flags & MULTIBOOT_INFO_CMDLINE) {
+    reclaimed += reclaim_range(mbi, mbi->cmdline, mbi->cmdline + 1, stages);
+  }
+  if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+    reclaimed += reclaim_range(mbi, mbi->mmap_addr,
+                               mbi->mmap_addr + mbi->mmap_length, stages);
+  }
+  // Freed frames keep their contents until reallocated, so reading the map
+  // and mbi while releasing them is fine as long as nothing allocates
+  reclaimed += reclaim_range(mbi, mbi_phys, mbi_phys + sizeof(*mbi), stages);
+  return reclaimed;
+}
+
+// Drop the identity mapping of the first 4 MB. It is made of large pages (one
+// 4 MB page, or two 2 MB ones with PAE), so there is no page table to free,
+// just the PDEs and their TLB entries. Every physical pointer (multiboot data,
+// page_directory, page_table) stops working after this, so it runs last.
+static bool reclaim_identity_map(void) {
+  if ((kernel_page_directory[0] & 1) == 0)
+    return false; // Already gone
+
+  for (uint32_t virt = 0; virt < BOOT_MAP_SIZE;
+       virt += LARGE_PAGE_SIZE) {
+    set_pte(&kernel_page_directory[PDE_INDEX(virt)], 0);
+    invlpg(virt); // One entry covers the whole large page
+  }
+  return true;
+}
+
+// Staged reclaim pass, run once after every boot consumer of the selected
+// stages is done (ACPI tables parsed, modules started or copied, multiboot
+// data no longer read). Returns the number of frames handed back.
+uint32_t pfa_reclaim_boot_memory(multiboot_info_t *mbi, uint32_t stages) {
+  uint32_t total = 0;
+  uint32_t count;
+
+  uint32_t managed[NUM_ZONES];
+  for (uint32_t z = 0; z < NUM_ZONES; z++) {
+    managed[z] = zones[z].managed_frames;
+  }
+
+  printf("PFA: Reclaiming boot memory...\n");
+
+  if (stages & RECLAIM_ACPI) {
+    count = reclaim_acpi(mbi, stages);
+    printf("  - ACPI reclaimable: %u KB\n", count * 4);
+    total += count;
+  }
+  if (stages & RECLAIM_MODULES) {
+    count = reclaim_modules(mbi, stages);
+    printf("  - Module images: %u KB\n", count * 4);
+    total += count;
+  }
+  if (stages & RECLAIM_BOOT_INFO) {
+    count = reclaim_boot_info(mbi, stages);
+    printf("  - Multiboot info: %u KB\n", count * 4);
+    total += count;
+  }
+  if ((stages & RECLAIM_IDENTITY_MAP) && reclaim_identity_map()) {
+    printf("  - Identity map: dropped\n");
+  }
+
+  // Watermarks scale with the zone, redo them for the ones that grew
+  for (uint32_t z = 0; z < NUM_ZONES; z++) {
+    if (zones[z].managed_frames != managed[z])
+      zone_set_watermarks(&zones[z]);
+  }
+
+  printf("PFA: Reclaimed %u KB, %u frames free\n", total * 4,
+         vm_bitmap.free_frames);
+  return total;
+}
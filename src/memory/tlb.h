@@ -0,0 +1,141 @@
+#pragma once
+#include <memory/paging.h>
+#include <memory/pfa.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <util/printf.h>
+#include <util/util.h>
+
+// TLB flush batching for unmap paths (mmu_gather). Instead of an invlpg per
+// cleared PTE, an operation records the virtual ranges it invalidated and the
+// frames it wants to give back, then flushes once at the end:
+//
+//   mmu_gather_t tlb;
+//   tlb_gather_begin(&tlb);
+//   ... set_pte(pte, 0); tlb_gather_range(&tlb, virt, 1);
+//       tlb_gather_free(&tlb, phys, 0); ...
+//   tlb_gather_finish(&tlb);
+//
+// The flush picks per-page invlpg for small batches and a single full flush
+// once the batch is larger than tlb_flush_threshold pages (flush_tlb_all: the
+// kernel mappings are global, a plain CR3 reload would keep them). Frames are
+// only freed after the flush, so nothing can reach them through a stale TLB
+// entry once the PFA hands them out again. When other CPUs show up this is also
+// where the shootdown goes: one IPI carrying the whole batch, and the frames
+// are freed after every CPU has acknowledged it.
+#define TLB_GATHER_RANGES 16  // Ranges tracked before a full flush
+#define TLB_GATHER_FRAMES 64  // Frames queued before an early flush
+#define TLB_FLUSH_THRESHOLD_DEFAULT 32
+
+// Pages above which one full flush is cheaper than an invlpg per page
+uint32_t tlb_flush_threshold = TLB_FLUSH_THRESHOLD_DEFAULT;
+
+typedef struct {
+  uintptr_t start;
+  uint32_t pages;
+} tlb_range_t;
+
+typedef struct {
+  phys_addr_t phys;
+  uint32_t order; // Buddy order, 0 for a single frame
+} tlb_frame_t;
+
+typedef struct {
+  tlb_range_t ranges[TLB_GATHER_RANGES];
+  uint32_t num_ranges;
+  uint32_t pages;  // Total across ranges
+  bool flush_all;  // More ranges than fit, flush everything
+  tlb_frame_t frames[TLB_GATHER_FRAMES];
+  uint32_t num_frames;
+} mmu_gather_t;
+
+// Statistics
+uint32_t tlb_batches = 0;      // Flushes done by tlb_gather_finish
+uint32_t tlb_gathered = 0;     // Pages invalidated through the batches
+uint32_t tlb_invlpgs = 0;      // Of those, one invlpg each
+uint32_t tlb_full_flushes = 0; // Batches done with a full flush
+
+static inline void tlb_gather_begin(mmu_gather_t *tlb) {
+  tlb->num_ranges = 0;
+  tlb->pages = 0;
+  tlb->flush_all = false;
+  tlb->num_frames = 0;
+}
+
+// Record that the translations of pages pages from virt are stale. For a
+// large page, one page anywhere inside it is enough
+static void tlb_gather_range(mmu_gather_t *tlb, uintptr_t virt,
+                             uint32_t pages) {
+  virt &= ~(uintptr_t)(PAGE_SIZE - 1);
+  tlb->pages += pages;
+  if (tlb->flush_all)
+    return;
+
+  // Unmaps walk upwards, so most pages just extend the last range
+  if (tlb->num_ranges > 0) {
+    tlb_range_t *last = &tlb->ranges[tlb->num_ranges - 1];
+    if (last->start + last->pages * PAGE_SIZE == virt) {
+      last->pages += pages;
+      return;
+    }
+  }
+
+  if (tlb->num_ranges == TLB_GATHER_RANGES) {
+    tlb->flush_all = true;
+    return;
+  }
+  tlb->ranges[tlb->num_ranges].start = virt;
+  tlb->ranges[tlb->num_ranges].pages = pages;
+  tlb->num_ranges++;
+}
+
+// Flush everything gathered so far and free the queued frames
+void tlb_gather_finish(mmu_gather_t *tlb) {
+  if (tlb->pages > 0) {
+    if (tlb->flush_all || tlb->pages > tlb_flush_threshold) {
+      flush_tlb_all();
+      tlb_full_flushes++;
+    } else {
+      for (uint32_t r = 0; r < tlb->num_ranges; r++) {
+        for (uint32_t i = 0; i < tlb->ranges[r].pages; i++) {
+          invlpg(tlb->ranges[r].start + i * PAGE_SIZE);
+        }
+      }
+      tlb_invlpgs += tlb->pages;
+    }
+    tlb_gathered += tlb->pages;
+    tlb_batches++;
+  }
+
+  // No CPU can reach these anymore
+  for (uint32_t i = 0; i < tlb->num_frames; i++) {
+    if (tlb->frames[i].order == 0) {
+      pfa_free(tlb->frames[i].phys);
+    } else {
+      pfa_free_order(tlb->frames[i].phys, tlb->frames[i].order);
+    }
+  }
+
+  tlb_gather_begin(tlb);
+}
+
+// Queue a 2^order frame run for freeing after the flush. Call it after the
+// range that mapped it was gathered: a full queue flushes early
+static void tlb_gather_free(mmu_gather_t *tlb, phys_addr_t phys,
+                            uint32_t order) {
+  if (tlb->num_frames == TLB_GATHER_FRAMES)
+    tlb_gather_finish(tlb);
+
+  tlb->frames[tlb->num_frames].phys = phys;
+  tlb->frames[tlb->num_frames].order = order;
+  tlb->num_frames++;
+}
+
+void tlb_set_flush_threshold(uint32_t pages) { tlb_flush_threshold = pages; }
+
+void tlb_print_stats(void) {
+  printf("TLB: %u batches, %u pages (%u by invlpg), %u full flushes, "
+         "threshold %u pages\n",
+         tlb_batches, tlb_gathered, tlb_invlpgs, tlb_full_flushes,
+         tlb_flush_threshold);
+}
@@ -1,109 +1,605 @@
 #pragma once
 #include "memory/memory.h"
 #include <memory/pfa.h>
+#include <memory/tlb.h>
+#include <memory/vma_tree.h>
 #include <stdint.h>
-#include <util/bitmap.h>
 #include <util/util.h>
 
-#define PD_BASE_VADDR 0xFFC00000
-#define GET_PT(pde_index) (PD_BASE_VADDR + (pde_index << 12))
+// Kernel virtual range handed out by vma_alloc. Everything from 0xC0000000 up
+// to VMA_START is left for the kernel image and permanently mapped low memory,
+// everything from VMA_END up for fixed mappings and the recursive PD.
+#define VMA_START (DIRECT_MAP_BASE + DIRECT_MAP_SIZE) // 0xF0000000
+#define VMA_END FIXMAP_BASE
 
-vm_bitmap_t kernel_vm_bitmap;
+// vma_alloc flags. They are kept with the region, so faults and frees in it
+// map the same way. Mappings are present, writable, supervisor only, global
+// and no-execute unless a flag says otherwise; regions with VMA_USER are never
+// global, their translations belong to one address space. The caching flags
+// are for vma_map_phys only, see VMA_CACHE_FLAGS.
+#define VMA_LARGE (1 << 0)    // Back LARGE_PAGE_SIZE-sized requests with PS pages
+#define VMA_LAZY (1 << 1)     // Only reserve, pages are populated on first touch
+#define VMA_READONLY (1 << 2) // No writes (kernel ones included, CR0.WP is set)
+#define VMA_USER (1 << 3)     // Accessible from ring 3
+#define VMA_EXEC (1 << 4)     // Executable, no NX
+#define VMA_NOCACHE (1 << 5)  // Uncached (PCD + PWT), for device registers
+#define VMA_WRITETHROUGH (1 << 6) // Cached for reads, writes go straight out
+#define VMA_WRITECOMBINE (1 << 7) // Uncached, writes merged into bursts (PAT)
 
-uintptr_t vma_alloc(uint32_t *pd, size_t bytes, uintptr_t hint,
-                    uint32_t flags) {
+// Memory types other than write-back. vma_alloc refuses them: its frames stay
+// mapped write-back in the direct map (or may be, the High zone falls back to
+// Normal and DMA), and one frame must never have two memory types
+#define VMA_CACHE_FLAGS (VMA_NOCACHE | VMA_WRITETHROUGH | VMA_WRITECOMBINE)
+
+// Pages mapped per demand fault: the aligned window around the faulting
+// page, clipped to the region and its page table, so sequential reads fault
+// once per window instead of once per page. Only a written page gets its own
+// frame, its neighbours map the zero page. Power of two, 1 disables
+// fault-around.
+#define VMA_FAULT_AROUND_DEFAULT 16
+#define VMA_FAULT_AROUND_MAX 64
+uint32_t vma_fault_around = VMA_FAULT_AROUND_DEFAULT;
+
+// Read faults in lazy regions map this one shared, read-only, zero-filled
+// frame instead of a fresh one. The first write to such a page takes a
+// protection fault and gets a private copy, so memory that is mostly read
+// only costs frames for the pages actually written.
+phys_addr_t vma_zero_page = 0;
+
+// Statistics
+uint32_t vma_demand_faults = 0;
+uint32_t vma_demand_pages = 0; // Private frames handed out by faults
+uint32_t vma_zero_maps = 0;    // PTEs pointed at the zero page
+uint32_t vma_cow_faults = 0;
+
+// Every region handed out by vma_alloc, see vma_tree.h
+vma_tree_t kernel_vmas;
+
+void init_vma() {
+  // Only [VMA_START, VMA_END) is up for grabs
+  vma_tree_init(&kernel_vmas, VMA_START, VMA_END);
+
+  vma_zero_page = pfa_alloc_zeroed();
+
+  // CR0.WP: make kernel writes honour read-only PTEs too, otherwise they'd
+  // go straight into the shared zero page instead of faulting
+  asm volatile("mov %%cr0, %%eax; or $0x10000, %%eax; mov %%eax, %%cr0"
+               :
+               :
+               : "eax");
+}
+
+// Region containing virt, or NULL (for the page fault handler)
+vma_t *vma_lookup(uintptr_t virt) { return vma_tree_find(&kernel_vmas, virt); }
+
+// PTE bits for a region's pages. PS PDEs take the same bits: the PAT bit,
+// which would collide with PDE_PS, only comes from VMA_WRITECOMBINE, and that
+// never reaches vma_alloc_large
+static pte_t vma_pte_flags(uint32_t flags) {
+  pte_t bits = PTE_PRESENT;
+  if (!(flags & VMA_READONLY))
+    bits |= PTE_WRITE;
+  if (flags & VMA_USER)
+    bits |= PTE_USER;
+  else
+    bits |= pte_global;
+  if (!(flags & VMA_EXEC))
+    bits |= pte_nx;
+  if (flags & VMA_NOCACHE)
+    bits |= PTE_PCD | PTE_PWT;
+  else if (flags & VMA_WRITECOMBINE)
+    bits |= pte_wc;
+  else if (flags & VMA_WRITETHROUGH)
+    bits |= PTE_PWT;
+  return bits;
+}
+
+// ============= Page Table Reclaim =============
+// Present PTEs per page table, indexed by PDE. Every PTE vma.h installs or
+// clears goes through this count, and when it drops to zero the PT itself is
+// freed, so churning large mappings doesn't leave empty PTs behind.
+static uint16_t pt_live_count[NUM_PDES];
+uint32_t vma_pt_reclaimed = 0; // PT frames given back so far
+
+// Free a PT whose last PTE was just cleared. The PDE goes first, then the
+// cached walk for its range and the PT's own recursive mapping go into the
+// batch, and the frame is only reused once that has been flushed.
+static void vma_reclaim_pt(pte_t *pd, mmu_gather_t *tlb, uint32_t pde_index) {
+  phys_addr_t pt_phys = pd[pde_index] & PTE_ADDR_MASK;
+  set_pte(&pd[pde_index], 0);
+  tlb_gather_range(tlb, (uint32_t)pde_index << PDE_SHIFT, 1);
+  tlb_gather_range(tlb, GET_PT(pde_index), 1);
+  tlb_gather_free(tlb, pt_phys, 0);
+  pt_live_count[pde_index] = 0;
+  vma_pt_reclaimed++;
+}
+
+// Make sure PDE pde_index has a PT. User pages need the U/S bit in the PDE as
+// well, the CPU takes the stricter of the two levels.
+// Returns false if there's no memory for the PT
+static bool vma_ensure_pt(pte_t *pd, uint32_t pde_index, uint32_t flags) {
+  if ((pd[pde_index] & PTE_PRESENT) == 0) {
+    alloc_new_pt(pd, pde_index);
+    if ((pd[pde_index] & PTE_PRESENT) == 0)
+      return false;
+  }
+  if ((flags & VMA_USER) && !(pd[pde_index] & PTE_USER))
+    set_pte(&pd[pde_index], pd[pde_index] | PTE_USER);
+  return true;
+}
+
+// Give back a PT that a failed fault set up and left without mappings
+static void vma_release_unused_pt(pte_t *pd, uint32_t pde_index) {
+  if ((pd[pde_index] & 1) == 0 || pt_live_count[pde_index] != 0)
+    return;
+
+  mmu_gather_t tlb;
+  tlb_gather_begin(&tlb);
+  vma_reclaim_pt(pd, &tlb, pde_index);
+  tlb_gather_finish(&tlb);
+}
+
+// Unmap num_pages starting at virt_start. Invalidations and the frames to
+// give back are collected in tlb, the caller flushes with tlb_gather_finish.
+// Frames of a region that doesn't own them (owned false) are left alone
+static void vma_unmap_pages(pte_t *pd, mmu_gather_t *tlb, uintptr_t virt_start,
+                            uint32_t num_pages, bool owned) {
+  uint32_t page = 0;
+  while (page < num_pages) {
+    uintptr_t virt = virt_start + page * PAGE_SIZE;
+
+    uint32_t pde_index = PDE_INDEX(virt);
+    uint32_t pte_index = PTE_INDEX(virt);
+
+    if ((pd[pde_index] & 1) == 0) {
+      page += PAGES_PER_PT - pte_index;
+      continue; // No PT (never populated, or reclaimed) - skip all of it
+    }
+
+    if (pd[pde_index] & PDE_PS) {
+      // Large page: one physical run, one PDE and one TLB entry
+      phys_addr_t phys =
+          pd[pde_index] & PTE_ADDR_MASK & ~(pte_t)(LARGE_PAGE_SIZE - 1);
+      set_pte(&pd[pde_index], 0);
+      tlb_gather_range(tlb, virt, 1);
+      tlb_gather_free(tlb, phys, LARGE_PAGE_ORDER);
+      page += PAGES_PER_PT - pte_index;
+      continue;
+    }
+
+    pte_t *pt = (pte_t *)GET_PT(pde_index);
+
+    if ((pt[pte_index] & 1) == 0) { // Not present - skip
+      page++;
+      continue;
+    }
+
+    // Get phys, clear PTE, return to PFA after the flush
+    phys_addr_t page_phys = pt[pte_index] & PTE_ADDR_MASK;
+    set_pte(&pt[pte_index], 0); // Clear
+    tlb_gather_range(tlb, virt, 1);
+    if (owned && page_phys != vma_zero_page)
+      tlb_gather_free(tlb, page_phys, 0);
+
+    page++;
+
+    if (--pt_live_count[pde_index] == 0) {
+      vma_reclaim_pt(pd, tlb, pde_index);
+    }
+  }
+}
+
+// Back a LARGE_PAGE_SIZE-multiple request (4MB, or 2MB with PAE) with large
+// pages: one PDE (PS=1) and one contiguous, size aligned physical run per
+// chunk, and no page tables at all.
+// Returns 0 if there's no aligned virtual range or physical run left.
+static uintptr_t vma_alloc_large(pte_t *pd, size_t bytes, uintptr_t hint,
+                                 uint32_t flags) {
+  uint32_t num_pages = bytes / PAGE_SIZE;
+  uint32_t num_pdes = bytes / LARGE_PAGE_SIZE;
+
+  uintptr_t virt_start =
+      vma_tree_find_gap(&kernel_vmas, hint, num_pages, PAGES_PER_PT);
+  if (virt_start == 0)
+    return 0;
+
+  uint32_t first_pde = PDE_INDEX(virt_start);
+  vma_t *vma = vma_tree_insert(&kernel_vmas, virt_start, num_pages, flags,
+                               VMA_BACKING_LARGE);
+  if (vma == NULL)
+    return 0;
+
+  mmu_gather_t tlb;
+  tlb_gather_begin(&tlb);
+
+  pte_t bits = vma_pte_flags(flags) | PDE_PS;
+
+  for (uint32_t i = 0; i < num_pdes; i++) {
+    uint32_t pde_index = first_pde + i;
+
+    // One buddy block of exactly one large page, aligned to its size
+    phys_addr_t phys = pfa_alloc_zone(ZONE_HIGH, LARGE_PAGE_ORDER);
+    if (phys == 0) {
+      // Rollback
+      vma_unmap_pages(pd, &tlb, virt_start, i * PAGES_PER_PT, true);
+      tlb_gather_finish(&tlb);
+      vma_tree_remove(&kernel_vmas, vma);
+      return 0;
+    }
+
+    // A PT left behind by a failed 4KB mapping gets replaced. None of its
+    // pages are mapped, otherwise the range wouldn't have been free
+    if (pd[pde_index] & 1) {
+      vma_reclaim_pt(pd, &tlb, pde_index);
+    }
+
+    set_pte(&pd[pde_index], phys | bits);
+  }
+  tlb_gather_finish(&tlb); // Only if PTs were replaced
+
+  printf("VMA: Allocated %u large pages (%u kb) at virt %p\n", num_pdes,
+         (uint32_t)B_TO_KB(bytes), virt_start);
+  return virt_start;
+}
+
+uintptr_t vma_alloc(pte_t *pd, size_t bytes, uintptr_t hint, uint32_t flags) {
   if (bytes == 0)
     return 0;
+  if (flags & VMA_CACHE_FLAGS) {
+    printf("VMA: Caching flags %x only apply to vma_map_phys\n",
+           flags & VMA_CACHE_FLAGS);
+    return 0;
+  }
+
+  // Large page sized requests can skip page tables entirely
+  if ((flags & VMA_LARGE) && bytes % LARGE_PAGE_SIZE == 0) {
+    uintptr_t virt = vma_alloc_large(pd, bytes, hint, flags);
+    if (virt != 0)
+      return virt;
+    // No aligned space or large run left, fall back to regular pages
+  }
 
   // Calculate required pages (ceiling)
   uint32_t num_pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+  flags &= ~VMA_LARGE; // Whatever happened above, these are 4KB pages
 
-  // Find free virtual range (page index in bitmap)
-  int32_t start_page_idx =
-      bitmap_find_free_range(&kernel_vm_bitmap, num_pages, hint);
-  if (start_page_idx == -1) {
+  // Find the lowest free virtual range at or above the hint
+  uintptr_t virt_start = vma_tree_find_gap(&kernel_vmas, hint, num_pages, 1);
+  if (virt_start == 0) {
     printf("VMM: No free virtual space for %u pages\n", num_pages);
     return 0;
   }
 
-  // Calculate starting virtual address
-  uintptr_t virt_start = (uintptr_t)start_page_idx * PAGE_SIZE;
+  // Record the region (before mapping, to reserve it)
+  vma_t *vma = vma_tree_insert(&kernel_vmas, virt_start, num_pages, flags,
+                               VMA_BACKING_ANON);
+  if (vma == NULL)
+    return 0;
 
-  // Mark as used (before mapping, to reserve)
-  bitmap_mark_range_used(&kernel_vm_bitmap, start_page_idx, num_pages);
+  if (flags & VMA_LAZY) {
+    // Nothing to map, vma_handle_fault fills the pages in as they're touched
+    printf("VMA: Reserved %u pages (%u kb) at virt %p\n", num_pages,
+           (uint32_t)B_TO_KB((num_pages * PAGE_SIZE)), virt_start);
+    return virt_start;
+  }
 
-  // For each page in the range: Ensure PDE/PT exists, alloc phys, set PTE
-  for (uint32_t page = 0; page < num_pages; page++) {
-    uintptr_t virt = virt_start + page * PAGE_SIZE;
+  // Map one page table's worth of pages per step: a single bulk frame
+  // allocation, then a straight run of PTE writes. The PTEs were not present
+  // before, and x86 never caches non-present translations, so no invlpg.
+  phys_addr_t frames[PAGES_PER_PT];
+  uint32_t mapped = 0;
+  while (mapped < num_pages) {
+    uintptr_t virt = virt_start + mapped * PAGE_SIZE;
 
     // Calculate PDE and PTE indexes
-    uint32_t pde_index = virt >> 22;           // Top 10 bits
-    uint32_t pte_index = (virt >> 12) & 0x3FF; // Next 10 bits
+    uint32_t pde_index = PDE_INDEX(virt);
+    uint32_t pte_index = PTE_INDEX(virt);
 
-    // Ensure PT exists for this PDE
-    if ((pd[pde_index] & 1) == 0) { // Check Present bit
-      alloc_new_pt(pd, pde_index);
+    // Pages left in this PT
+    uint32_t count = PAGES_PER_PT - pte_index;
+    if (count > num_pages - mapped) {
+      count = num_pages - mapped;
     }
 
-    // Direct access to PT via recursive mapping
-    uint32_t *pt = (uint32_t *)GET_PT(pde_index);
+    // Ensure PT exists for this PDE
+    if (!vma_ensure_pt(pd, pde_index, flags))
+      break; // Out of memory for the PT itself
 
-    // Alloc physical frame for this page
-    uintptr_t page_phys = pfa_alloc();
-    if (page_phys == 0) {
-      // Rollback
-      bitmap_mark_range_free(&kernel_vm_bitmap, start_page_idx, num_pages);
-      return 0;
-    }
+    // Physical frames for this chunk. They are only ever touched through this
+    // mapping, so they don't need to come from directly mapped memory (with
+    // PAE they may well sit above 4GB)
+    uint32_t got = pfa_alloc_bulk_zone(ZONE_HIGH, count, frames);
 
-    pt[pte_index] = (uint32_t)page_phys | 0b11; // Present (1) + R/W (2);
+    // Direct access to PT via recursive mapping
+    pte_t *pt = (pte_t *)GET_PT(pde_index);
+    pte_t bits = vma_pte_flags(flags);
+    for (uint32_t i = 0; i < got; i++) {
+      set_pte(&pt[pte_index + i], frames[i] | bits);
+    }
 
-    invlpg(virt);
+    pt_live_count[pde_index] += got;
+    mapped += got;
+    if (got < count) {
+      // Out of physical memory. A PT that just came in with nothing mapped
+      // has no count to drop to zero in the rollback, free it here
+      if (got == 0)
+        vma_release_unused_pt(pd, pde_index);
+      break;
+    }
   }
 
-  // TODO Store flags somewhere (e.g., in a separate VMA list for advanced
-  // tracking)
+  if (mapped < num_pages) {
+    // Rollback
+    mmu_gather_t tlb;
+    tlb_gather_begin(&tlb);
+    vma_unmap_pages(pd, &tlb, virt_start, mapped, true);
+    tlb_gather_finish(&tlb);
+    vma_tree_remove(&kernel_vmas, vma);
+    printf("VMA: Out of memory after %u of %u pages\n", mapped, num_pages);
+    return 0;
+  }
 
   printf("VMA: Allocated %u pages (%u kb) at virt %p (hint %p, flags %x)\n",
-         num_pages, B_TO_KB((num_pages * PAGE_SIZE)), virt_start, hint, flags);
+         num_pages, (uint32_t)B_TO_KB((num_pages * PAGE_SIZE)), virt_start,
+         hint, flags);
   return virt_start;
 }
 
-void vma_free(uint32_t *pd, uintptr_t virt_start, size_t bytes) {
-  if (bytes == 0 || virt_start == 0)
-    return;
+// Map an existing physical range, typically device registers or a frame
+// buffer, into the vma_alloc range. The frames stay the caller's: vma_free
+// only removes the mapping. phys doesn't have to be page aligned, the
+// returned pointer carries the same offset. VMA_LARGE and VMA_LAZY don't
+// apply. Returns 0 if there's no virtual space or PT memory left.
+uintptr_t vma_map_phys(pte_t *pd, phys_addr_t phys, size_t bytes,
+                       uintptr_t hint, uint32_t flags) {
+  if (bytes == 0)
+    return 0;
 
-  uint32_t num_pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
-  uint32_t start_page_idx = virt_start / PAGE_SIZE;
+  uint32_t offset = phys & (PAGE_SIZE - 1);
+  phys -= offset;
+  uint32_t num_pages = (offset + bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+  flags &= ~(VMA_LARGE | VMA_LAZY);
 
-  // For each page, return phys to PFA
+  uintptr_t virt_start = vma_tree_find_gap(&kernel_vmas, hint, num_pages, 1);
+  if (virt_start == 0) {
+    printf("VMA: No free virtual space for %u pages\n", num_pages);
+    return 0;
+  }
+  vma_t *vma = vma_tree_insert(&kernel_vmas, virt_start, num_pages, flags,
+                               VMA_BACKING_PHYS);
+  if (vma == NULL)
+    return 0;
+
+  pte_t bits = vma_pte_flags(flags);
   for (uint32_t page = 0; page < num_pages; page++) {
     uintptr_t virt = virt_start + page * PAGE_SIZE;
+    uint32_t pde_index = PDE_INDEX(virt);
 
-    uint32_t pde_index = virt >> 22;
-    uint32_t pte_index = (virt >> 12) & 0x3FF;
+    if (!vma_ensure_pt(pd, pde_index, flags)) {
+      // Rollback, nothing of ours to free
+      mmu_gather_t tlb;
+      tlb_gather_begin(&tlb);
+      vma_unmap_pages(pd, &tlb, virt_start, page, false);
+      tlb_gather_finish(&tlb);
+      vma_tree_remove(&kernel_vmas, vma);
+      return 0;
+    }
 
-    if ((pd[pde_index] & 1) == 0)
-      continue; // No PT - skip (shouldn't happen)
+    pte_t *pt = (pte_t *)GET_PT(pde_index);
+    set_pte(&pt[PTE_INDEX(virt)], (phys + page * PAGE_SIZE) | bits);
+    pt_live_count[pde_index]++;
+  }
 
-    uintptr_t pt_phys = pd[pde_index] & ~0xFFF;
-    uint32_t *pt = (uint32_t *)GET_PT(pde_index);
+  printf("VMA: Mapped frame %u (%u pages) at virt %p (flags %x)\n",
+         (uint32_t)(phys / PAGE_SIZE), num_pages, virt_start, flags);
+  return virt_start + offset;
+}
 
-    if ((pt[pte_index] & 1) == 0) { // Not present - skip
-      continue;
+// Take [phys, phys + bytes) out of the direct map. For frames that get mapped
+// elsewhere with another memory type (see vma_map_phys): Intel doesn't support
+// two types for one frame. The large page holding them is split into a page
+// table with the same mapping minus the range, so the range has to lie within
+// one large page. Meant for device memory, phys_to_virt must not be used on
+// it afterwards. Returns false when out of memory for the page table.
+bool vma_unmap_direct(phys_addr_t phys, size_t bytes) {
+  phys_addr_t start = phys & ~(phys_addr_t)(PAGE_SIZE - 1);
+  phys_addr_t end = CEIL_DIV(phys + bytes, PAGE_SIZE) * PAGE_SIZE;
+  uint32_t pde_index = PDE_INDEX(DIRECT_MAP_BASE + start);
+  if (bytes == 0 || end > direct_map_end ||
+      PDE_INDEX(DIRECT_MAP_BASE + end - 1) != pde_index) {
+    printf("VMA: Can't unmap 0x%x-0x%x from the direct map\n",
+           (uint32_t)start, (uint32_t)end);
+    return false;
+  }
+
+  pte_t *pde = &kernel_page_directory[pde_index];
+  if (*pde & PDE_PS) {
+    phys_addr_t pt_phys = pfa_alloc();
+    if (pt_phys == 0)
+      return false;
+
+    // Same frames and bits in 4KB pages. The PAT bit moves back down to
+    // bit 7, where a PS PDE keeps the page size flag
+    pte_t large = *pde;
+    pte_t base = large & PTE_ADDR_MASK & ~(pte_t)(LARGE_PAGE_SIZE - 1);
+    pte_t bits = large & ~(pte_t)(PTE_ADDR_MASK | PDE_PS);
+    if (large & PDE_PAT)
+      bits |= PTE_PAT;
+
+    pte_t *pt = (pte_t *)phys_to_virt(pt_phys);
+    for (uint32_t i = 0; i < PAGES_PER_PT; i++) {
+      pt[i] = (base + i * PAGE_SIZE) | bits;
     }
+    set_pte(pde, pt_phys | PTE_WRITE | PTE_PRESENT);
+  }
+
+  pte_t *pt = (pte_t *)GET_PT(pde_index);
+  for (phys_addr_t p = start; p < end; p += PAGE_SIZE) {
+    set_pte(&pt[PTE_INDEX(DIRECT_MAP_BASE + p)], 0);
+  }
+  flush_tlb_all(); // The split replaced a global large page
+  return true;
+}
 
-    // Get phys, clear PTE, return to PFA
-    pt[pte_index] = 0; // Clear
-    pfa_free(pt_phys); // Assume you have this to mark free in PFA bitmap
+void vma_free(pte_t *pd, uintptr_t virt_start, size_t bytes) {
+  if (bytes == 0 || virt_start == 0)
+    return;
 
-    invlpg(virt);
+  // vma_map_phys may have handed out an address inside the first page
+  bytes += virt_start & (PAGE_SIZE - 1);
+  virt_start &= ~(uintptr_t)(PAGE_SIZE - 1);
+  uint32_t num_pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+  vma_t *vma = vma_tree_find(&kernel_vmas, virt_start);
+  if (vma == NULL || virt_start + num_pages * PAGE_SIZE > vma_end(vma)) {
+    printf("VMA: Free of %u pages at virt %p is outside any region\n",
+           num_pages, virt_start);
+    return;
   }
 
-  // Mark free in bitmap
-  bitmap_mark_range_free(&kernel_vm_bitmap, start_page_idx, num_pages);
+  // Large pages can only be given back whole
+  if (vma->backing == VMA_BACKING_LARGE &&
+      ((virt_start - vma->start) % LARGE_PAGE_SIZE ||
+       num_pages % PAGES_PER_PT)) {
+    printf("VMA: Partial free of a large page at virt %p\n", virt_start);
+    return;
+  }
 
-  // TODO If entire PT becomes empty, free it and clear PDE (optimize memory)
+  // The region may be gone after the punch
+  bool owned = vma->backing != VMA_BACKING_PHYS;
+
+  // Shrink, split or drop the region first, a split may run out of nodes
+  if (!vma_tree_punch(&kernel_vmas, vma, virt_start, num_pages))
+    return;
+
+  // Unmap everything, then one flush for the whole range (a full flush
+  // past tlb_flush_threshold pages) before the frames go back to the PFA
+  mmu_gather_t tlb;
+  tlb_gather_begin(&tlb);
+  vma_unmap_pages(pd, &tlb, virt_start, num_pages, owned);
+  tlb_gather_finish(&tlb);
 
   printf("VMA: Freed %u pages at virt %p\n", num_pages, virt_start);
 }
+
+void vma_set_fault_around(uint32_t pages) {
+  if (pages > VMA_FAULT_AROUND_MAX)
+    pages = VMA_FAULT_AROUND_MAX;
+  if (pages == 0)
+    pages = 1;
+  vma_fault_around = 1u << (31 - __builtin_clz(pages)); // Round down to 2^n
+}
+
+// Write to a page that maps the shared zero page: give it a private frame.
+// Copying a zero page means clearing the new one
+static bool vma_cow_fault(pte_t *pd, vma_t *vma, uintptr_t virt) {
+  if (vma->flags & VMA_READONLY)
+    return false; // The write itself is the bug
+
+  uint32_t pde_index = PDE_INDEX(virt);
+  if ((pd[pde_index] & 1) == 0 || (pd[pde_index] & PDE_PS))
+    return false;
+
+  pte_t *pte = &((pte_t *)GET_PT(pde_index))[PTE_INDEX(virt)];
+  if ((*pte & PTE_ADDR_MASK) != vma_zero_page || (*pte & 0b10))
+    return false; // Not ours, a genuine protection fault
+
+  phys_addr_t phys = pfa_alloc_frame(ZONE_HIGH);
+  if (phys == 0)
+    return false;
+
+  uintptr_t page = virt & ~(uintptr_t)(PAGE_SIZE - 1);
+  set_pte(pte, phys | vma_pte_flags(vma->flags));
+  invlpg(page); // The read-only translation may still be cached
+  memset32((void *)page, 0, PAGE_SIZE / sizeof(uint32_t));
+
+  vma_cow_faults++;
+  vma_demand_pages++;
+  return true;
+}
+
+// Demand paging: back the missing page at virt, and the missing neighbours
+// in its fault-around window. Everything maps the shared zero page except a
+// written page, which gets a fresh zeroed frame, and writes to zero page
+// mappings are copied on write.
+// Returns false if virt isn't in a lazy region, it was some other protection
+// fault, or memory ran out, so the caller treats it as a real fault.
+bool vma_handle_fault(pte_t *pd, uintptr_t virt, uint32_t error_code) {
+  vma_t *vma = vma_lookup(virt);
+  if (vma == NULL || !(vma->flags & VMA_LAZY))
+    return false;
+
+  if (error_code & PF_PRESENT) {
+    if (error_code & PF_WRITE)
+      return vma_cow_fault(pd, vma, virt);
+    return false;
+  }
+  if ((error_code & PF_WRITE) && (vma->flags & VMA_READONLY))
+    return false;
+
+  // Window around the page, clipped to the region and to one PT
+  uintptr_t page = virt & ~(uintptr_t)(PAGE_SIZE - 1);
+  uintptr_t window = vma_fault_around * PAGE_SIZE;
+  uintptr_t start = page & ~(window - 1);
+  uintptr_t end = start + window;
+  uintptr_t pt_start = page & ~(uintptr_t)(LARGE_PAGE_SIZE - 1);
+  if (start < vma->start)
+    start = vma->start;
+  if (start < pt_start)
+    start = pt_start;
+  if (end > vma_end(vma))
+    end = vma_end(vma);
+  if (end > pt_start + LARGE_PAGE_SIZE)
+    end = pt_start + LARGE_PAGE_SIZE;
+
+  uint32_t pde_index = PDE_INDEX(page);
+  if (!vma_ensure_pt(pd, pde_index, vma->flags))
+    return false; // Out of memory for the PT itself
+  pte_t *pt = (pte_t *)GET_PT(pde_index);
+  pte_t bits = vma_pte_flags(vma->flags);
+
+  if ((error_code & PF_WRITE) || vma_zero_page == 0) {
+    if (vma->flags & VMA_READONLY) {
+      // No zero page to read, and no writing the page to clear
+      vma_release_unused_pt(pd, pde_index);
+      return false;
+    }
+
+    // Only the page actually written gets a frame, pre-zeroed from the PFA's
+    // zero pool when it can. The PTE wasn't present, so there's no TLB entry
+    // to flush
+    phys_addr_t phys = pfa_alloc_zeroed();
+    if (phys == 0) {
+      vma_release_unused_pt(pd, pde_index);
+      return false; // Out of memory
+    }
+    set_pte(&pt[PTE_INDEX(page)], phys | bits);
+    pt_live_count[pde_index]++;
+    vma_demand_pages++;
+  }
+
+  if (vma_zero_page != 0) {
+    // The rest of the window (all of it for a read) maps the zero page,
+    // read-only. Reads cost no memory and a later write copies on write, so
+    // the region only costs frames for the pages written
+    pte_t zero_bits = bits & ~(pte_t)PTE_WRITE;
+    for (uintptr_t v = start; v < end; v += PAGE_SIZE) {
+      if ((pt[PTE_INDEX(v)] & 1) == 0) {
+        set_pte(&pt[PTE_INDEX(v)], vma_zero_page | zero_bits);
+        pt_live_count[pde_index]++;
+        vma_zero_maps++;
+      }
+    }
+  }
+
+  vma_demand_faults++;
+  return true;
+}
+
+void vma_print_fault_stats(void) {
+  printf("VMA: %u demand faults, %u private pages, %u zero page maps, "
+         "%u copy-on-write faults\n",
+         vma_demand_faults, vma_demand_pages, vma_zero_maps, vma_cow_faults);
+  printf("VMA: %u page tables reclaimed (%u KB)\n", vma_pt_reclaimed,
+         vma_pt_reclaimed * (PAGE_SIZE / 1024));
+}
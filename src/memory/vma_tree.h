@@ -0,0 +1,479 @@
+#pragma once
+#include <memory/paging.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <util/printf.h>
+#include <util/util.h>
+
+// Virtual memory regions, kept in a red-black tree ordered by start address.
+// Besides its own range every node records the free gap between the previous
+// region and itself, plus the largest such gap anywhere in its subtree. That
+// makes both lookups by address and the search for a free range O(log n):
+// subtrees whose largest gap is too small are never entered. A zero-length
+// sentinel region at the top of the managed range turns the space after the
+// last real region into an ordinary gap.
+
+// What is behind a region's pages
+typedef enum {
+  VMA_BACKING_NONE = 0, // Nothing mapped (the sentinel)
+  VMA_BACKING_ANON,     // 4KB frames from the PFA, one PTE each
+  VMA_BACKING_LARGE,    // Large pages, one buddy block per PDE
+  VMA_BACKING_PHYS,     // Caller's physical range (MMIO), frames not owned
+} vma_backing_t;
+
+typedef struct vma {
+  uintptr_t start;
+  uint32_t num_pages;
+  uint32_t flags; // vma_alloc flags
+  vma_backing_t backing;
+
+  uint32_t gap;     // Free pages between the previous region and this one
+  uint32_t max_gap; // Largest gap in this subtree
+  struct vma *parent;
+  struct vma *left;
+  struct vma *right;
+  bool red;
+} vma_t;
+
+typedef struct {
+  vma_t *root;
+  uintptr_t base; // Managed range is [base, limit)
+  uintptr_t limit;
+  uint32_t count;      // Nodes, sentinel excluded
+  uint32_t used_pages; // Pages covered by those regions
+} vma_tree_t;
+
+// Nodes come from a fixed pool, there is no kernel heap to take them from
+#define VMA_MAX_REGIONS 512
+
+static vma_t vma_pool[VMA_MAX_REGIONS];
+static vma_t *vma_pool_free = NULL; // Released nodes, chained through right
+static uint32_t vma_pool_used = 0;  // Nodes never handed out start here
+
+static vma_t *vma_node_alloc(void) {
+  vma_t *node;
+  if (vma_pool_free != NULL) {
+    node = vma_pool_free;
+    vma_pool_free = node->right;
+  } else if (vma_pool_used < VMA_MAX_REGIONS) {
+    node = &vma_pool[vma_pool_used++];
+  } else {
+    return NULL;
+  }
+
+  memset(node, 0, sizeof(*node));
+  return node;
+}
+
+static void vma_node_free(vma_t *node) {
+  node->right = vma_pool_free;
+  vma_pool_free = node;
+}
+
+static inline uintptr_t vma_end(const vma_t *vma) {
+  return vma->start + vma->num_pages * PAGE_SIZE;
+}
+
+// ============= Gap Bookkeeping =============
+
+static void vma_update_max_gap(vma_t *node) {
+  uint32_t max = node->gap;
+  if (node->left != NULL && node->left->max_gap > max)
+    max = node->left->max_gap;
+  if (node->right != NULL && node->right->max_gap > max)
+    max = node->right->max_gap;
+  node->max_gap = max;
+}
+
+// Refresh max_gap on the path from node up to the root
+static void vma_propagate(vma_t *node) {
+  while (node != NULL) {
+    vma_update_max_gap(node);
+    node = node->parent;
+  }
+}
+
+static vma_t *vma_prev(vma_t *node) {
+  if (node->left != NULL) {
+    node = node->left;
+    while (node->right != NULL)
+      node = node->right;
+    return node;
+  }
+  while (node->parent != NULL && node == node->parent->left)
+    node = node->parent;
+  return node->parent;
+}
+
+static vma_t *vma_next(vma_t *node) {
+  if (node->right != NULL) {
+    node = node->right;
+    while (node->left != NULL)
+      node = node->left;
+    return node;
+  }
+  while (node->parent != NULL && node == node->parent->right)
+    node = node->parent;
+  return node->parent;
+}
+
+// Recompute the gap in front of node from its current predecessor
+static void vma_refresh_gap(vma_tree_t *tree, vma_t *node) {
+  vma_t *prev = vma_prev(node);
+  uintptr_t gap_start = prev != NULL ? vma_end(prev) : tree->base;
+  node->gap = (node->start - gap_start) / PAGE_SIZE;
+  vma_propagate(node);
+}
+
+// ============= Red-Black Tree =============
+
+// Rotations keep max_gap right locally; the rotated subtree as a whole holds
+// the same nodes, so nothing above it changes
+static void vma_rotate_left(vma_tree_t *tree, vma_t *x) {
+  vma_t *y = x->right;
+  x->right = y->left;
+  if (y->left != NULL)
+    y->left->parent = x;
+  y->parent = x->parent;
+  if (x->parent == NULL)
+    tree->root = y;
+  else if (x == x->parent->left)
+    x->parent->left = y;
+  else
+    x->parent->right = y;
+  y->left = x;
+  x->parent = y;
+
+  vma_update_max_gap(x);
+  vma_update_max_gap(y);
+}
+
+static void vma_rotate_right(vma_tree_t *tree, vma_t *x) {
+  vma_t *y = x->left;
+  x->left = y->right;
+  if (y->right != NULL)
+    y->right->parent = x;
+  y->parent = x->parent;
+  if (x->parent == NULL)
+    tree->root = y;
+  else if (x == x->parent->right)
+    x->parent->right = y;
+  else
+    x->parent->left = y;
+  y->right = x;
+  x->parent = y;
+
+  vma_update_max_gap(x);
+  vma_update_max_gap(y);
+}
+
+static inline bool vma_is_red(vma_t *node) {
+  return node != NULL && node->red;
+}
+
+static void vma_insert_fixup(vma_tree_t *tree, vma_t *z) {
+  while (vma_is_red(z->parent)) {
+    vma_t *parent = z->parent;
+    vma_t *grandparent = parent->parent;
+
+    if (parent == grandparent->left) {
+      vma_t *uncle = grandparent->right;
+      if (vma_is_red(uncle)) {
+        parent->red = false;
+        uncle->red = false;
+        grandparent->red = true;
+        z = grandparent;
+        continue;
+      }
+      if (z == parent->right) {
+        z = parent;
+        vma_rotate_left(tree, z);
+        parent = z->parent;
+      }
+      parent->red = false;
+      grandparent->red = true;
+      vma_rotate_right(tree, grandparent);
+    } else {
+      vma_t *uncle = grandparent->left;
+      if (vma_is_red(uncle)) {
+        parent->red = false;
+        uncle->red = false;
+        grandparent->red = true;
+        z = grandparent;
+        continue;
+      }
+      if (z == parent->left) {
+        z = parent;
+        vma_rotate_right(tree, z);
+        parent = z->parent;
+      }
+      parent->red = false;
+      grandparent->red = true;
+      vma_rotate_left(tree, grandparent);
+    }
+  }
+  tree->root->red = false;
+}
+
+// Put v where u was, as far as u's parent is concerned
+static void vma_transplant(vma_tree_t *tree, vma_t *u, vma_t *v) {
+  if (u->parent == NULL)
+    tree->root = v;
+  else if (u == u->parent->left)
+    u->parent->left = v;
+  else
+    u->parent->right = v;
+  if (v != NULL)
+    v->parent = u->parent;
+}
+
+// x may be NULL (an empty leaf), so its parent is passed along explicitly
+static void vma_erase_fixup(vma_tree_t *tree, vma_t *x, vma_t *parent) {
+  while (x != tree->root && !vma_is_red(x)) {
+    if (x == parent->left) {
+      vma_t *w = parent->right;
+      if (vma_is_red(w)) {
+        w->red = false;
+        parent->red = true;
+        vma_rotate_left(tree, parent);
+        w = parent->right;
+      }
+      if (!vma_is_red(w->left) && !vma_is_red(w->right)) {
+        w->red = true;
+        x = parent;
+        parent = x->parent;
+        continue;
+      }
+      if (!vma_is_red(w->right)) {
+        w->left->red = false;
+        w->red = true;
+        vma_rotate_right(tree, w);
+        w = parent->right;
+      }
+      w->red = parent->red;
+      parent->red = false;
+      if (w->right != NULL)
+        w->right->red = false;
+      vma_rotate_left(tree, parent);
+      x = tree->root;
+    } else {
+      vma_t *w = parent->left;
+      if (vma_is_red(w)) {
+        w->red = false;
+        parent->red = true;
+        vma_rotate_right(tree, parent);
+        w = parent->left;
+      }
+      if (!vma_is_red(w->left) && !vma_is_red(w->right)) {
+        w->red = true;
+        x = parent;
+        parent = x->parent;
+        continue;
+      }
+      if (!vma_is_red(w->left)) {
+        w->right->red = false;
+        w->red = true;
+        vma_rotate_left(tree, w);
+        w = parent->left;
+      }
+      w->red = parent->red;
+      parent->red = false;
+      if (w->left != NULL)
+        w->left->red = false;
+      vma_rotate_right(tree, parent);
+      x = tree->root;
+    }
+  }
+  if (x != NULL)
+    x->red = false;
+}
+
+// ============= Tree API =============
+
+// Add a region. The range must be free (found with vma_tree_find_gap).
+// Returns NULL when the node pool is exhausted.
+vma_t *vma_tree_insert(vma_tree_t *tree, uintptr_t start, uint32_t num_pages,
+                       uint32_t flags, vma_backing_t backing) {
+  vma_t *node = vma_node_alloc();
+  if (node == NULL) {
+    printf("VMA: Out of region descriptors\n");
+    return NULL;
+  }
+  node->start = start;
+  node->num_pages = num_pages;
+  node->flags = flags;
+  node->backing = backing;
+  node->red = true;
+
+  vma_t *parent = NULL;
+  vma_t **link = &tree->root;
+  while (*link != NULL) {
+    parent = *link;
+    link = start < parent->start ? &parent->left : &parent->right;
+  }
+  node->parent = parent;
+  *link = node;
+
+  // The new node splits the gap in front of its successor in two
+  vma_refresh_gap(tree, node);
+  vma_t *next = vma_next(node);
+  if (next != NULL)
+    vma_refresh_gap(tree, next);
+
+  vma_insert_fixup(tree, node);
+
+  if (backing != VMA_BACKING_NONE) {
+    tree->count++;
+    tree->used_pages += num_pages;
+  }
+  return node;
+}
+
+// Remove a region, its pages become part of the gap in front of its successor
+void vma_tree_remove(vma_tree_t *tree, vma_t *z) {
+  vma_t *next = vma_next(z);
+  vma_t *x;
+  vma_t *x_parent;
+  bool removed_red = z->red;
+
+  if (z->left == NULL) {
+    x = z->right;
+    x_parent = z->parent;
+    vma_transplant(tree, z, z->right);
+  } else if (z->right == NULL) {
+    x = z->left;
+    x_parent = z->parent;
+    vma_transplant(tree, z, z->left);
+  } else {
+    // Two children: z's successor (next) takes its place
+    vma_t *y = next;
+    removed_red = y->red;
+    x = y->right;
+    if (y->parent == z) {
+      x_parent = y;
+    } else {
+      x_parent = y->parent;
+      vma_transplant(tree, y, y->right);
+      y->right = z->right;
+      y->right->parent = y;
+    }
+    vma_transplant(tree, z, y);
+    y->left = z->left;
+    y->left->parent = y;
+    y->red = z->red;
+  }
+
+  vma_propagate(x_parent);
+  if (!removed_red)
+    vma_erase_fixup(tree, x, x_parent);
+
+  if (next != NULL)
+    vma_refresh_gap(tree, next);
+
+  if (z->backing != VMA_BACKING_NONE) {
+    tree->count--;
+    tree->used_pages -= z->num_pages;
+  }
+  vma_node_free(z);
+}
+
+// Take [start, start + num_pages) out of a region: it shrinks from either
+// end, splits in two around a hole in the middle, or goes away entirely.
+// Returns false (and changes nothing) if a split finds the node pool empty.
+bool vma_tree_punch(vma_tree_t *tree, vma_t *vma, uintptr_t start,
+                    uint32_t num_pages) {
+  uintptr_t end = start + num_pages * PAGE_SIZE;
+  uintptr_t vma_last = vma_end(vma);
+
+  if (start == vma->start && end == vma_last) {
+    vma_tree_remove(tree, vma);
+    return true;
+  }
+
+  if (start == vma->start) {
+    // Head: the region starts later, its own gap grows
+    vma->start = end;
+    vma->num_pages -= num_pages;
+    vma_refresh_gap(tree, vma);
+  } else if (end == vma_last) {
+    // Tail: the gap in front of the next region grows
+    vma->num_pages -= num_pages;
+    vma_t *next = vma_next(vma);
+    if (next != NULL)
+      vma_refresh_gap(tree, next);
+  } else {
+    // Middle: keep the head here, the tail becomes a region of its own
+    uint32_t old_pages = vma->num_pages;
+    uint32_t head_pages = (start - vma->start) / PAGE_SIZE;
+    vma->num_pages = head_pages;
+    tree->used_pages -= old_pages - head_pages;
+    if (vma_tree_insert(tree, end, (vma_last - end) / PAGE_SIZE, vma->flags,
+                        vma->backing) == NULL) {
+      vma->num_pages = old_pages;
+      tree->used_pages += old_pages - head_pages;
+      return false;
+    }
+    return true; // vma_tree_insert counted the tail
+  }
+
+  tree->used_pages -= num_pages;
+  return true;
+}
+
+// Region containing addr, or NULL
+vma_t *vma_tree_find(vma_tree_t *tree, uintptr_t addr) {
+  vma_t *node = tree->root;
+  while (node != NULL) {
+    if (addr < node->start)
+      node = node->left;
+    else if (addr >= vma_end(node))
+      node = node->right;
+    else
+      return node;
+  }
+  return NULL;
+}
+
+static uintptr_t vma_find_gap_in(vma_t *node, uintptr_t low,
+                                 uint32_t num_pages, uint32_t align_pages) {
+  if (node == NULL || node->max_gap < num_pages)
+    return 0;
+
+  // Every gap in the left subtree, and our own, ends by node->start
+  if (node->start > low) {
+    uintptr_t found =
+        vma_find_gap_in(node->left, low, num_pages, align_pages);
+    if (found != 0)
+      return found;
+
+    uintptr_t gap_start = node->start - node->gap * PAGE_SIZE;
+    uintptr_t candidate = gap_start > low ? gap_start : low;
+    uint32_t align = align_pages * PAGE_SIZE;
+    candidate = CEIL_DIV(candidate, align) * align;
+    if ((uint64_t)candidate + (uint64_t)num_pages * PAGE_SIZE <= node->start)
+      return candidate;
+  }
+
+  return vma_find_gap_in(node->right, low, num_pages, align_pages);
+}
+
+// Lowest address at or above low where num_pages free pages start on a
+// multiple of align_pages. Returns 0 if there is no such range.
+uintptr_t vma_tree_find_gap(vma_tree_t *tree, uintptr_t low,
+                            uint32_t num_pages, uint32_t align_pages) {
+  if (num_pages == 0)
+    return 0;
+  if (low < tree->base)
+    low = tree->base;
+  return vma_find_gap_in(tree->root, low, num_pages, align_pages);
+}
+
+void vma_tree_init(vma_tree_t *tree, uintptr_t base, uintptr_t limit) {
+  tree->root = NULL;
+  tree->base = base;
+  tree->limit = limit;
+  tree->count = 0;
+  tree->used_pages = 0;
+  vma_tree_insert(tree, limit, 0, 0, VMA_BACKING_NONE); // Sentinel
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include <memory/buddy.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <util/printf.h>
+
+// Physical memory zones. DMA is what ISA devices can reach, Normal is the low
+// memory the kernel can keep permanently mapped in its higher half, and High
+// is everything above it, which is only reachable through temporary mappings
+// (with PAE that includes the frames past 4 GB).
+// Both boundaries are 4 MB aligned, so buddy blocks never straddle two zones.
+#define ZONE_DMA_END_FRAME (0x01000000 / PAGE_SIZE)    // 16 MB
+#define ZONE_NORMAL_END_FRAME (DIRECT_MAP_SIZE / PAGE_SIZE) // 768 MB
+
+typedef enum { ZONE_DMA = 0, ZONE_NORMAL, ZONE_HIGH, NUM_ZONES } zone_type_t;
+
+typedef struct {
+  const char *name;
+  uint32_t start_frame; // Span covered by the zone
+  uint32_t end_frame;
+  uint32_t present_frames; // Usable RAM reported by the memory map
+  uint32_t managed_frames; // Frames handed to the buddy allocator
+  uint32_t free_frames;
+
+  // Watermarks in frames. Allocations that fall back into this zone from a
+  // higher one must leave at least `low` free, allocations that prefer this
+  // zone may go down to `min`. Below `high` the zone counts as under pressure
+  // and background work (like the zero pool) stops taking frames from it.
+  uint32_t watermark_min;
+  uint32_t watermark_low;
+  uint32_t watermark_high;
+
+  buddy_area_t area;
+} zone_t;
+
+zone_t zones[NUM_ZONES] = {
+    {.name = "DMA", .start_frame = 0, .end_frame = ZONE_DMA_END_FRAME},
+    {.name = "Normal",
+     .start_frame = ZONE_DMA_END_FRAME,
+     .end_frame = ZONE_NORMAL_END_FRAME},
+    {.name = "High",
+     .start_frame = ZONE_NORMAL_END_FRAME,
+     .end_frame = PFA_MAX_FRAMES},
+};
+
+static inline zone_type_t zone_type_of_frame(uint32_t frame) {
+  if (frame < ZONE_DMA_END_FRAME)
+    return ZONE_DMA;
+  if (frame < ZONE_NORMAL_END_FRAME)
+    return ZONE_NORMAL;
+  return ZONE_HIGH;
+}
+
+static inline zone_t *zone_of_frame(uint32_t frame) {
+  return &zones[zone_type_of_frame(frame)];
+}
+
+// Credit the usable frames of one memory map region to the zones it overlaps
+static void zone_account_region(uint32_t start_frame, uint32_t num_frames) {
+  uint32_t end_frame = start_frame + num_frames;
+
+  for (uint32_t z = 0; z < NUM_ZONES; z++) {
+    uint32_t start =
+        start_frame > zones[z].start_frame ? start_frame : zones[z].start_frame;
+    uint32_t end =
+        end_frame < zones[z].end_frame ? end_frame : zones[z].end_frame;
+    if (start < end) {
+      zones[z].present_frames += end - start;
+    }
+  }
+}
+
+static void zone_set_watermarks(zone_t *zone) {
+  // Keep ~0.4% of each zone in reserve, at least 8 frames and at most 4 MB
+  uint32_t min = zone->managed_frames / 256;
+  if (min < 8)
+    min = 8;
+  if (min > 1024)
+    min = 1024;
+
+  zone->watermark_min = min;
+  zone->watermark_low = min + min / 4;
+  zone->watermark_high = min + min / 2;
+}
+
+// Clamp the zones to installed memory and seed each zone's buddy allocator
+// from the free frames in the bitmap
+static void zones_init(uint32_t total_frames) {
+  for (uint32_t z = 0; z < NUM_ZONES; z++) {
+    zone_t *zone = &zones[z];
+    if (zone->end_frame > total_frames) {
+      zone->end_frame = total_frames;
+    }
+    if (zone->start_frame >= zone->end_frame) {
+      zone->end_frame = zone->start_frame; // Empty zone
+      buddy_init(&zone->area, zone->start_frame, 0);
+      continue;
+    }
+
+    buddy_init(&zone->area, zone->start_frame,
+               zone->end_frame - zone->start_frame);
+    zone->managed_frames = buddy_seed_from_bitmap(&zone->area);
+    zone->free_frames = zone->managed_frames;
+    zone_set_watermarks(zone);
+  }
+}
+
+static inline bool zone_watermark_ok(zone_t *zone, uint32_t order,
+                                     uint32_t mark) {
+  return zone->free_frames >= BUDDY_BLOCK_FRAMES(order) + mark;
+}
+
+// Allocate from this zone only, as long as it stays above `mark`.
+// Returns the first frame number, or -1.
+static int32_t zone_alloc(zone_t *zone, uint32_t order, uint32_t mark) {
+  if (!zone_watermark_ok(zone, order, mark))
+    return -1;
+
+  int32_t frame = buddy_alloc(&zone->area, order);
+  if (frame >= 0) {
+    zone->free_frames -= BUDDY_BLOCK_FRAMES(order);
+  }
+  return frame;
+}
+
+static void zone_free(zone_t *zone, uint32_t frame, uint32_t order) {
+  buddy_free(&zone->area, frame, order);
+  zone->free_frames += BUDDY_BLOCK_FRAMES(order);
+}
+
+void zone_print_stats(void) {
+  printf("ZONE: Physical memory zones:\n");
+  for (uint32_t z = 0; z < NUM_ZONES; z++) {
+    zone_t *zone = &zones[z];
+    printf("  - %s: frames [%u, %u), %u present, %u free (watermarks %u/%u/%u)\n",
+           zone->name, zone->start_frame, zone->end_frame, zone->present_frames,
+           zone->free_frames, zone->watermark_min, zone->watermark_low,
+           zone->watermark_high);
+  }
+}
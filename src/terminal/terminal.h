@@ -63,6 +63,12 @@ void terminal_init(void) {
   print_greeting();
 }
 
+// Move the console to another mapping of the same VGA memory, e.g. one with
+// a better memory type than the boot mapping. The screen stays as it is
+void terminal_set_framebuffer(uint16_t *framebuffer) {
+  term.framebuffer = framebuffer;
+}
+
 void terminal_clear(void) {
   for (size_t i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
     term.framebuffer[i] = vga_make_entry(' ', term.color);
@@ -1,22 +1,20 @@
 #pragma once
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <util/util.h>
 
 #define BITS_PER_BYTE 8
 
 // Constants
 #define PAGE_SIZE 4096
-#define PAGES_PER_PT 1024              // 1024 PTEs per PT (4MB)
-#define NUM_PDES 1024                  // 1024 PDEs in PD (4GB)
-#define BITMAP_SIZE (1 << 20)          // 1M pages in 4GB space (2^20 bits)
-#define BITMAP_WORDS (BITMAP_SIZE / 8) // Bytes needed for bitmap (128KB)
 
 typedef struct vm_bitmap {
   uint8_t *bitmap;      // Each bit represents one 4KB frame
   uint32_t bitmap_size; // In bytes
   uint32_t total_frames;
   uint32_t free_frames;
-  uintptr_t max_phys_addr;
+  uint64_t max_phys_addr; // Can be past 4GB with PAE
 } vm_bitmap_t;
 
 static void bitmap_set(uint8_t *bitmap, uint32_t bit) {
@@ -31,65 +29,125 @@ static int bitmap_test(uint8_t *bitmap, uint32_t bit) {
   return bitmap[bit / BITS_PER_BYTE] & (1 << (bit % BITS_PER_BYTE));
 }
 
-// ============= Bitmap Helper Functions =============
-static void bitmap_mark_range_used_old(vm_bitmap_t vm_bitmap,
-                                       uint32_t start_frame,
-                                       uint32_t num_frames) {
-  for (uint32_t i = 0;
-       i < num_frames && (start_frame + i) < vm_bitmap.total_frames; i++) {
-    bitmap_set(vm_bitmap.bitmap, start_frame + i);
-  }
+// ============= Word Helpers =============
+// The range helpers below work on whole 32-bit words: partial head and tail
+// words are masked, full words in between are filled with rep stosd, and
+// searches skip 32 bits at a time with bsf. Bit i of byte i / 8 is bit i % 32
+// of word i / 32 on little-endian x86, so the byte helpers above still agree.
+#define BITMAP_WORD_BITS 32
+#define BITMAP_WORD_FULL 0xFFFFFFFF
+
+static inline uint32_t popcount32(uint32_t x) {
+  // No popcnt on our baseline i686 target and no libgcc to fall back on
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  x = (x + (x >> 4)) & 0x0F0F0F0F;
+  return (x * 0x01010101) >> 24;
 }
 
-void bitmap_mark_range_used(vm_bitmap_t *bitmap, uint32_t start_page,
-                            uint32_t num_pages) {
-  for (uint32_t i = start_page; i < start_page + num_pages; i++) {
-    uint32_t byte = i / 8;
-    uint32_t bit = i % 8;
-    bitmap->bitmap[byte] |= (1 << bit);
+// Mask of the bits from `bit` up to the top of the word
+static inline uint32_t bitmap_head_mask(uint32_t bit) {
+  return BITMAP_WORD_FULL << (bit % BITMAP_WORD_BITS);
+}
+
+// Mask of the bits from the bottom of the word up to and including `bit`
+static inline uint32_t bitmap_tail_mask(uint32_t bit) {
+  return BITMAP_WORD_FULL >> (BITMAP_WORD_BITS - 1 - bit % BITMAP_WORD_BITS);
+}
+
+static void bitmap_fill_range(uint8_t *bitmap, uint32_t start, uint32_t count,
+                              bool set) {
+  if (count == 0)
+    return;
+
+  uint32_t *words = (uint32_t *)bitmap;
+  uint32_t end = start + count - 1; // Last bit, inclusive
+  uint32_t first = start / BITMAP_WORD_BITS;
+  uint32_t last = end / BITMAP_WORD_BITS;
+  uint32_t head = bitmap_head_mask(start);
+  uint32_t tail = bitmap_tail_mask(end);
+
+  if (first == last) {
+    head &= tail;
+    words[first] = set ? (words[first] | head) : (words[first] & ~head);
+    return;
+  }
+
+  words[first] = set ? (words[first] | head) : (words[first] & ~head);
+  if (last - first > 1) {
+    memset32(&words[first + 1], set ? BITMAP_WORD_FULL : 0, last - first - 1);
   }
+  words[last] = set ? (words[last] | tail) : (words[last] & ~tail);
 }
 
-static void bitmap_mark_range_free_old(vm_bitmap_t vm_bitmap,
-                                       uint32_t start_frame,
-                                       uint32_t num_frames) {
-  for (uint32_t i = 0;
-       i < num_frames && (start_frame + i) < vm_bitmap.total_frames; i++) {
-    bitmap_clear(vm_bitmap.bitmap, start_frame + i);
+// First clear (free) bit in [start, end), or end if there is none
+static uint32_t bitmap_find_next_clear(const uint8_t *bitmap, uint32_t start,
+                                       uint32_t end) {
+  const uint32_t *words = (const uint32_t *)bitmap;
+  if (start >= end)
+    return end;
+
+  uint32_t w = start / BITMAP_WORD_BITS;
+  uint32_t word = ~words[w] & bitmap_head_mask(start);
+  while (word == 0) {
+    if (++w * BITMAP_WORD_BITS >= end)
+      return end;
+    word = ~words[w];
   }
+
+  uint32_t bit = w * BITMAP_WORD_BITS + __builtin_ctz(word);
+  return bit < end ? bit : end;
 }
 
-void bitmap_mark_range_free(vm_bitmap_t *bitmap, uint32_t start_page,
-                            uint32_t num_pages) {
-  for (uint32_t i = start_page; i < start_page + num_pages; i++) {
-    uint32_t byte = i / 8;
-    uint32_t bit = i % 8;
-    bitmap->bitmap[byte] &= ~(1 << bit);
+// First set (used) bit in [start, end), or end if there is none
+static uint32_t bitmap_find_next_set(const uint8_t *bitmap, uint32_t start,
+                                     uint32_t end) {
+  const uint32_t *words = (const uint32_t *)bitmap;
+  if (start >= end)
+    return end;
+
+  uint32_t w = start / BITMAP_WORD_BITS;
+  uint32_t word = words[w] & bitmap_head_mask(start);
+  while (word == 0) {
+    if (++w * BITMAP_WORD_BITS >= end)
+      return end;
+    word = words[w];
   }
+
+  uint32_t bit = w * BITMAP_WORD_BITS + __builtin_ctz(word);
+  return bit < end ? bit : end;
 }
 
-static int32_t bitmap_find_free_range(vm_bitmap_t *bitmap, uint32_t num_pages,
-                                      uintptr_t hint) {
-  uint32_t start_page =
-      (hint == 0) ? (0xC0000000 / PAGE_SIZE)
-                  : (hint / PAGE_SIZE); // Default to high kernel space
-  uint32_t total_pages = BITMAP_SIZE;
-
-  for (uint32_t i = start_page; i < total_pages; i++) {
-    uint32_t free_count = 0;
-    for (uint32_t j = i; j < i + num_pages && j < total_pages; j++) {
-      uint32_t byte = j / 8;
-      uint32_t bit = j % 8;
-      if (bitmap->bitmap[byte] & (1 << bit)) {
-        break; // Not free
-      }
-      free_count++;
-    }
-    if (free_count == num_pages) {
-      return i; // Found starting page index
-    }
-    i += free_count; // Skip to next potential start (optimize scan)
+// Number of clear (free) bits in [start, end)
+static uint32_t bitmap_count_clear(const uint8_t *bitmap, uint32_t start,
+                                   uint32_t end) {
+  const uint32_t *words = (const uint32_t *)bitmap;
+  if (start >= end)
+    return 0;
+
+  uint32_t first = start / BITMAP_WORD_BITS;
+  uint32_t last = (end - 1) / BITMAP_WORD_BITS;
+  uint32_t used = 0;
+
+  for (uint32_t w = first; w <= last; w++) {
+    uint32_t mask = BITMAP_WORD_FULL;
+    if (w == first)
+      mask &= bitmap_head_mask(start);
+    if (w == last)
+      mask &= bitmap_tail_mask(end - 1);
+    used += popcount32(words[w] & mask);
   }
-  // Wrap around if hint was high (optional; for simplicity, no wrap here)
-  return -1; // No space found
+
+  return (end - start) - used;
+}
+
+// ============= Bitmap Helper Functions =============
+void bitmap_mark_range_used(vm_bitmap_t *bitmap, uint32_t start_page,
+                            uint32_t num_pages) {
+  bitmap_fill_range(bitmap->bitmap, start_page, num_pages, true);
+}
+
+void bitmap_mark_range_free(vm_bitmap_t *bitmap, uint32_t start_page,
+                            uint32_t num_pages) {
+  bitmap_fill_range(bitmap->bitmap, start_page, num_pages, false);
 }
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+
+// CPUID and model specific register access
+
+typedef struct {
+  uint32_t eax;
+  uint32_t ebx;
+  uint32_t ecx;
+  uint32_t edx;
+} cpuid_regs_t;
+
+#define CPUID_FEATURES 1          // Standard feature flags
+#define CPUID_EDX_PGE (1 << 13)   // Global pages
+#define CPUID_EDX_PAT (1 << 16)   // Page attribute table
+
+#define CPUID_EXT_MAX 0x80000000  // eax = highest extended leaf
+#define CPUID_EXT_INFO 0x80000001 // Extended feature flags
+#define CPUID_EXT_EDX_NX (1 << 20)
+
+#define MSR_EFER 0xC0000080
+#define EFER_NXE (1 << 11) // No-execute enable
+
+#define MSR_PAT 0x277 // Page attribute table, 8 memory types of 8 bits each
+
+#define CR0_NW (1 << 29) // Not write-through
+#define CR0_CD (1 << 30) // Cache disable
+#define CR4_PGE (1 << 7) // Global pages enable
+
+static inline uint32_t read_cr0(void) {
+  uint32_t cr0;
+  asm volatile("mov %%cr0, %0" : "=r"(cr0));
+  return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+  asm volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+  uint32_t cr4;
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+  asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+// Write back and invalidate every cache line
+static inline void wbinvd(void) { asm volatile("wbinvd" : : : "memory"); }
+
+static inline cpuid_regs_t cpuid(uint32_t leaf) {
+  cpuid_regs_t regs;
+  asm volatile("cpuid"
+               : "=a"(regs.eax), "=b"(regs.ebx), "=c"(regs.ecx), "=d"(regs.edx)
+               : "a"(leaf), "c"(0));
+  return regs;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t low, high;
+  asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+  return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  asm volatile("wrmsr"
+               :
+               : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
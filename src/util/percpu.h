@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+
+// Uniprocessor for now: everything per-CPU is sized by MAX_CPUS and indexed by
+// cpu_id(), so SMP bring-up only has to change these two
+#define MAX_CPUS 1
+#define CACHE_LINE_SIZE 64
+#define __cacheline_aligned __attribute__((aligned(CACHE_LINE_SIZE)))
+
+// With one CPU the answer is always 0. Once application processors are
+// started this becomes the local APIC ID
+static inline uint32_t cpu_id(void) { return 0; }
+
+// Disable interrupts and return the previous EFLAGS, so the caller owns the
+// CPU-local data until irq_restore
+static inline uint32_t irq_save(void) {
+  uint32_t flags;
+  asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+// Re-enable interrupts only if they were enabled before irq_save
+static inline void irq_restore(uint32_t flags) {
+  if (flags & (1 << 9)) { // IF
+    asm volatile("sti" : : : "memory");
+  }
+}
+
+// Spinlock for the little data CPUs really share. Holders keep interrupts off
+// (irq_save first), so an interrupt handler on the same CPU never spins on a
+// lock its own CPU holds
+typedef struct {
+  uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT {0}
+
+static inline void spin_lock(spinlock_t *lock) {
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    // Wait on a plain load, so the line stays shared until it's released
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+      asm volatile("pause");
+  }
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
@@ -9,6 +9,15 @@ void memset(void *destination, char value, uint32_t num_bytes) {
   }
 }
 
+// Fill num_words 32-bit words with value using rep stosd
+static inline void memset32(void *destination, uint32_t value,
+                            uint32_t num_words) {
+  asm volatile("rep stosl"
+               : "+D"(destination), "+c"(num_words)
+               : "a"(value)
+               : "memory");
+}
+
 void *memcpy(void *destination, const void *source, uint32_t num_bytes) {
   char *dest_ptr = (char *)destination;
   const char *src_ptr = (const char *)source;
@@ -19,7 +28,13 @@ void *memcpy(void *destination, const void *source, uint32_t num_bytes) {
 }
 
 void invlpg(uint32_t virtual_address) {
-  asm volatile("invlpg %0" ::"m"(virtual_address));
+  // The operand is the page itself, not the variable holding its address
+  asm volatile("invlpg (%0)" ::"r"(virtual_address) : "memory");
+}
+
+// Drop the whole TLB by reloading CR3 with itself
+void flush_tlb(void) {
+  asm volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
 }
 
-#define CEIL_DIV(a, b) (((a + b) - 1) / b)
+#define CEIL_DIV(a, b) (((a) + (b) - 1) / (b))